@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Strong- and weak-scaling runs of pbratu, summarized from -log_view as CSV on stdout.
+# Used by the bench-strong and bench-weak targets of the makefile.
+#
+#   pbratu-scaling.sh strong|weak "<mpiexec>" "<rank counts>" <grid> [pbratu options]
+#
+# strong: every run solves the same <grid> x <grid> problem.
+# weak:   <grid> x <grid> is the problem at the first rank count; the other runs
+#         grow -da_grid_x/-da_grid_y so that the unknowns per rank stay constant.
+#
+# Times are the maximum over ranks in seconds, summed over the -log_view stages.
+# Parallel efficiency is relative to the first rank count:
+#   strong: (np0 T0) / (np T),  weak: T0 / T,  with T the SNESSolve time.
+
+if [ $# -lt 4 ]; then
+  echo "Usage: $0 strong|weak \"<mpiexec>\" \"<rank counts>\" <grid> [pbratu options]" >&2
+  exit 1
+fi
+mode=$1; mpiexec=$2; nps=$3; grid=$4
+shift 4
+case $mode in
+  strong|weak) ;;
+  *) echo "$0: unknown mode $mode" >&2; exit 1 ;;
+esac
+
+echo "mode,np,grid_x,grid_y,residual_s,ksp_s,snes_s,newton_its,linear_its,efficiency"
+np0=; t0=
+for np in $nps; do
+  [ -z "$np0" ] && np0=$np
+  if [ "$mode" = weak ]; then
+    n=`awk -v g=$grid -v np=$np -v np0=$np0 'BEGIN {printf "%d", (g-1)*sqrt(np/np0)+1.5}'`
+  else
+    n=$grid
+  fi
+  line=`$mpiexec -n $np ./pbratu -da_grid_x $n -da_grid_y $n "$@" -log_view | awk '
+    /Number of Newton iterations =/ {newton = $NF}
+    /Number of linear iterations =/ {linear = $NF}
+    $1 == "PBratuResidual"          {res  += $4}
+    $1 == "KSPSolve"                {ksp  += $4}
+    $1 == "SNESSolve"               {snes += $4}
+    END {printf "%g,%g,%g,%s,%s", res, ksp, snes, newton, linear}'`
+  t=`echo $line | cut -d, -f3`
+  [ -z "$t0" ] && t0=$t
+  eff=`awk -v m=$mode -v np=$np -v np0=$np0 -v t=$t -v t0=$t0 'BEGIN {
+    if (t <= 0) {print "nan"; exit}
+    if (m == "strong") printf "%.3f", np0*t0/(np*t); else printf "%.3f", t0/t}'`
+  echo "$mode,$np,$n,$n,$line,$eff"
+done
@@ -1,11 +1,12 @@
-static const char help[] = "p-Bratu nonlinear PDE in 2d.\n\
+static const char help[] = "p-Bratu nonlinear PDE in 2d and 3d.\n\
 We solve the  p-Laplacian (nonlinear diffusion) combined with\n\
 the Bratu (solid fuel ignition) nonlinearity in a 2D rectangular\n\
-domain, using distributed arrays (DAs) to partition the parallel grid.\n\
+or 3D box domain, using distributed arrays (DAs) to partition the parallel grid.\n\
 \n\
-This example currently requires -snes_mf\n\
-\n\
-This example currently only solves the linear part (a 2-Laplacian)\n\
+  -lambda <parameter>, where <parameter> indicates the problem's nonlinearity\n\
+  -p <2>: `p' in p-Laplacian term\n\
+  -epsilon <1e-05>: Strain-regularization in p-Laplacian\n\
+  -pbratu_dim <2>: spatial dimension, 2 or 3\n\
 \n";
 
 /* ------------------------------------------------------------------------
@@ -21,7 +22,9 @@ This example currently only solves the linear part (a 2-Laplacian)\n\
 
     with boundary conditions
 
-        u = 0  for  x = 0, x = 1, y = 0, y = 1.
+        u = 0  for  x = 0, x = 1, y = 0, y = 1
+
+    by default; in 2D, -pbratu_bc selects periodic or Neumann sides instead.
 
     A finite difference approximation a 9-point stencil is used to discretize
     the boundary value problem to obtain a nonlinear system of equations.
@@ -29,8 +32,29 @@ This example currently only solves the linear part (a 2-Laplacian)\n\
 
     Program usage:  mpiexec -n <procs> ./pbratu [-help] [all PETSc options]
      e.g.,
-      ./pbratu -fd_jacobian -mat_fd_coloring_view_draw -draw_pause -1
-      mpiexec -n 2 ./pbratu -fd_jacobian_ghosted -log_summary
+      ./pbratu -pbratu_jacobian_type fd -mat_fd_coloring_view draw -draw_pause -1
+      mpiexec -n 4 ./pbratu -p 3 -lambda 1 -da_refine 5 -pc_type mg -snes_monitor -ksp_converged_reason
+      mpiexec -n 4 ./pbratu -p 4 -snes_grid_sequence 5 -pc_type mg
+      ./pbratu -da_grid_x 129 -da_grid_y 129 -pbratu_p_schedule 2,2.5,3,3.5,4 -pbratu_continuation_secant
+      mpiexec -n 4 ./pbratu -pbratu_bc_x periodic -pbratu_bc_y dirichlet -p 3 -lambda 1 -da_refine 4 -pc_type mg
+      ./pbratu -da_grid_x 2049 -da_grid_y 2049 -p 3 -pbratu_bench 100 -pbratu_stream_bw 20 -log_view
+      mpiexec -n 4 ./pbratu -p 3 -da_refine 5 -pc_type mg -pbratu_memory_report
+      mpiexec -n 16 ./pbratu -da_grid_x 257 -da_grid_y 257 -pbratu_overlap -log_view
+      mpiexec -n 4 ./pbratu -p 4 -da_refine 5 -pc_type gamg -pbratu_lag -snes_monitor
+      mpiexec -n 4 ./pbratu -p 4 -da_refine 5 -pbratu_picard -pbratu_picard_switch_rtol 1e-3 -pc_type gamg -snes_monitor
+      mpiexec -n 4 ./pbratu -p 3 -da_grid_x 513 -da_grid_y 513 -pbratu_eta_cache -log_view
+      mpiexec -n 4 ./pbratu -p 3 -da_grid_x 257 -da_grid_y 257 -pbratu_jacobian_type shell -ksp_type cg -ksp_converged_reason
+      mpiexec -n 4 ./pbratu -p 3 -da_grid_x 513 -da_grid_y 513 -ksp_type cg -pbratu_precision_compare
+      mpiexec -n 4 ./pbratu -p 3 -lambda 1 -da_grid_x 513 -da_grid_y 513 -pc_type gamg -pbratu_fastmath_compare
+      ./pbratu -p 3 -da_grid_x 2049 -da_grid_y 2049 -dm_vec_type cuda -ksp_type cg
+      mpiexec -n 16 ./pbratu -da_grid_x 4097 -da_grid_y 129 -pbratu_partition halo -pbratu_partition_report
+      mpiexec -n 8 ./pbratu -pbratu_p_schedule 2,3,4,5 -pbratu_restart run.h5 -pbratu_checkpoint run.h5
+      mpiexec -n 4 ./pbratu -p 4 -da_grid_x 1025 -da_grid_y 1025 -pbratu_output snap -pbratu_output_stride 4
+      mpiexec -n 64 ./pbratu -p 3 -pbratu_p_schedule 2,3 -da_refine 6 -pc_type mg -pbratu_telemetry run.json
+      mpiexec -n 32 ./pbratu -da_grid_x 64 -da_grid_y 64 -pbratu_ensemble params.txt -pbratu_ensemble_size 2
+      printf -- '-p 3 -lambda 1\n-da_grid_x 129 -da_grid_y 129 -snes_rtol 1e-10\nquit\n' | ./pbratu -pc_type gamg -pbratu_server -
+      mpiexec -n 4 ./pbratu -p 5 -da_refine 6 -snes_type fas -snes_fas_levels 7 -fas_levels_snes_type ngs -fas_levels_snes_ngs_sweeps 2 -fas_coarse_snes_type newtonls -snes_monitor
+      mpiexec -n 8 ./pbratu -pbratu_dim 3 -p 3 -lambda 1 -da_refine 3 -pc_type mg -snes_monitor
 
   ------------------------------------------------------------------------- */
 
@@ -46,6 +70,151 @@ This example currently only solves the linear part (a 2-Laplacian)\n\
 */
 #include "petscdmda.h"
 #include "petscsnes.h"
+#if defined(PETSC_HAVE_HDF5)
+#include "petscviewerhdf5.h"
+#endif
+
+/*
+   The solution output of -pbratu_output is written by a helper thread when PETSc
+   has pthreads
+*/
+#include <errno.h>
+#if defined(PETSC_HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+/*
+   Explicit SIMD residual kernel, selected at build time by make PBRATU_SIMD=avx2|avx512|neon.
+   The intrinsics operate on real double precision scalars only.
+*/
+#if (defined(PBRATU_SIMD_AVX512) || defined(PBRATU_SIMD_AVX2) || defined(PBRATU_SIMD_NEON)) && !defined(PETSC_USE_COMPLEX) && defined(PETSC_USE_REAL_DOUBLE)
+#define PBRATU_HAVE_SIMD
+#endif
+#if defined(PBRATU_HAVE_SIMD) && (defined(PBRATU_SIMD_AVX512) || defined(PBRATU_SIMD_AVX2))
+#include <immintrin.h>
+#elif defined(PBRATU_HAVE_SIMD)
+#include <arm_neon.h>
+#endif
+
+/*
+   GPU residual and matrix-free Jacobian (pbratu_cuda.cu), built with make PBRATU_CUDA=1
+   against a PETSc configured --with-cuda, and used when the vectors of the DMDA are
+   VECCUDA (-dm_vec_type cuda); the Jacobian is then the MATSHELL, and the vectors stay on
+   the device for the whole solve.  -pbratu_bench always times the host kernel.
+*/
+#if defined(PBRATU_CUDA) && defined(PETSC_HAVE_CUDA) && !defined(PETSC_USE_COMPLEX)
+#define PBRATU_HAVE_CUDA
+#include "pbratu_cuda.h"
+#endif
+
+/*
+   Approximate exp() and pow() of -pbratu_fastmath, which work on the bits of real
+   double precision scalars
+*/
+#if !defined(PETSC_USE_COMPLEX) && defined(PETSC_USE_REAL_DOUBLE)
+#define PBRATU_HAVE_FASTMATH
+#include <stdint.h>
+#endif
+
+/*
+   Hybrid MPI+OpenMP: built with make PBRATU_OPENMP=1, the residual and initial
+   guess loops are threaded over the rows owned by each process.
+*/
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/*
+   Implementations of the interior residual kernel, selected with -pbratu_kernel
+*/
+typedef enum {PBRATU_KERNEL_SCALAR,PBRATU_KERNEL_SIMD} PBratuKernelType;
+static const char *const PBratuKernelTypes[] = {"scalar","simd","PBratuKernelType","PBRATU_KERNEL_",0};
+
+/*
+   Transfer of the nonlinear state to the coarse levels of geometric multigrid, selected
+   with -pbratu_mg_restrict: scaled restriction (the SNES default) or injection
+*/
+typedef enum {PBRATU_RESTRICT_RESTRICT,PBRATU_RESTRICT_INJECT} PBratuRestrictType;
+static const char *const PBratuRestrictTypes[] = {"restrict","inject","PBratuRestrictType","PBRATU_RESTRICT_",0};
+
+/*
+   Representation of the Newton Jacobian, selected with -pbratu_jacobian_type: the assembled
+   AIJ matrix of the DMDA, a MATSHELL that applies the exact linearization matrix-free, or
+   the AIJ matrix computed by finite differences with a coloring of the stencil
+*/
+typedef enum {PBRATU_JACOBIAN_AIJ,PBRATU_JACOBIAN_SHELL,PBRATU_JACOBIAN_FD} PBratuJacobianType;
+static const char *const PBratuJacobianTypes[] = {"aij","shell","fd","PBratuJacobianType","PBRATU_JACOBIAN_",0};
+
+/*
+   Precision of the coefficients cached by the matrix-free Jacobian, selected with
+   -pbratu_jacobian_precision: PetscScalar, or single (float) with the products
+   accumulated in PetscScalar, which halves the coefficient traffic of MatMult()
+*/
+typedef enum {PBRATU_PRECISION_DOUBLE,PBRATU_PRECISION_SINGLE} PBratuPrecisionType;
+static const char *const PBratuPrecisionTypes[] = {"double","single","PBratuPrecisionType","PBRATU_PRECISION_",0};
+
+/*
+   Process grid of the DMDA, selected with -pbratu_partition: the choice of DMSetUp()
+   (PETSC_DECIDE, or -da_processors_x ...), or the factorization of the number of ranks
+   with the shortest cuts between the subdomains, see SetUpPartition()
+*/
+typedef enum {PBRATU_PARTITION_PETSC,PBRATU_PARTITION_HALO} PBratuPartitionType;
+static const char *const PBratuPartitionTypes[] = {"petsc","halo","PBratuPartitionType","PBRATU_PARTITION_",0};
+
+/*
+   Boundary condition in each direction of the 2D grid, selected with -pbratu_bc, -pbratu_bc_x
+   and -pbratu_bc_y, and the DMDA boundary type that implements it (see InteriorRange())
+*/
+typedef enum {PBRATU_BC_DIRICHLET,PBRATU_BC_PERIODIC,PBRATU_BC_NEUMANN} PBratuBCType;
+static const char *const PBratuBCTypes[] = {"dirichlet","periodic","neumann","PBratuBCType","PBRATU_BC_",0};
+static const DMBoundaryType PBratuBCBoundaryTypes[] = {DM_BOUNDARY_NONE,DM_BOUNDARY_PERIODIC,DM_BOUNDARY_GHOSTED};
+
+/*
+   Adaptive lagging of the Jacobian and preconditioner (-pbratu_lag), see LagUpdate()
+*/
+typedef struct {
+  PetscBool on;
+  PetscReal itsratio;       /* rebuild both when the linear iterations grow by more than this factor */
+  PetscReal stall;          /* rebuild the Jacobian when a Newton step reduces ||F|| by less than this factor */
+  PetscInt  lits0;          /* linear iterations of the first solve with the current preconditioner */
+  PetscReal fnorm;          /* ||F|| before the previous Newton step */
+  PetscBool pcnew;          /* the preconditioner was rebuilt for the previous Newton step */
+  PetscInt  njac,npc,nsteps;/* rebuilds of the Jacobian and preconditioner, and Newton steps */
+} LagPolicy;
+
+/*
+   Picard linearization (-pbratu_picard), see FormJacobianPicardLocal() and PicardMonitor()
+*/
+typedef struct {
+  PetscBool on;
+  PetscReal rtol;           /* switch to Newton once ||F|| < rtol ||F_0||; 0 never switches */
+  PetscReal fnorm0;         /* ||F|| at the start of the current solve */
+  PetscBool newton;         /* the current solve has switched to Newton */
+  PetscBool switched;       /* it switched since the last update of -pbratu_lag */
+  PetscInt  npicard,nnewton;/* Picard and Newton steps */
+} PicardPolicy;
+
+/*
+   Cache of the face diffusivities eta and their derivatives deta (-pbratu_eta_cache), composed
+   with each DMDA by EtaCacheGet().  The faces are those of the JacobianShell layout; the
+   coefficients were computed from the state `state' of the global vector with id `id', at
+   the given p and epsilon, whose ghosted local form x is kept to recognize a copy of it.
+   Hits and misses are the counts of the events PBratuEtaReuse and PBratuEtaCompute.
+*/
+typedef struct {
+  PetscInt         is,ie,js,je;
+  PetscScalar      *ex,*dex;  /* x-faces (i+1/2,j), js <= j < je, is-1 <= i < ie, row by row */
+  PetscScalar      *ey,*dey;  /* y-faces (i,j+1/2), js-1 <= j < je, is <= i < ie, row by row */
+  PetscScalar      *x;        /* ghosted local values of the state */
+  PetscInt         nx;        /* entries of x */
+  PetscBool        valid;
+  PetscObjectId    id;
+  PetscObjectState state;
+  PetscReal        p,epsilon;
+  PetscBool        fastmath;
+} EtaCache;
+#define PBRATU_XFACE(c,i,j) (((j)-(c)->js)*((c)->ie-(c)->is+1)+(i)-(c)->is+1) /* index of face (i+1/2,j) */
+#define PBRATU_YFACE(c,i,j) (((j)-(c)->js+1)*((c)->ie-(c)->is)+(i)-(c)->is)   /* index of face (i,j+1/2) */
 
 /*
    User-defined application context - contains data needed by the
@@ -53,14 +222,599 @@ This example currently only solves the linear part (a 2-Laplacian)\n\
    FormFunctionLocal().
 */
 typedef struct {
-  PetscInt dummy;
+  PetscReal lambda;         /* Bratu parameter */
+  PetscReal p;              /* Exponent in p-Laplacian */
+  PetscReal epsilon;        /* Regularization */
+  PBratuKernelType kernel;  /* Implementation of the interior residual kernel */
+  PetscInt  tile[2];        /* Tile size in i and j of the interior residual traversal; 0 means untiled */
+  PBratuRestrictType mgrestrict; /* Transfer of the state to coarse multigrid levels */
+  PBratuJacobianType jtype; /* Representation of the Newton Jacobian */
+  PBratuPrecisionType jprecision; /* Precision of the matrix-free Jacobian coefficients */
+  PetscInt  ncolors;        /* Colors of the last finite-difference Jacobian coloring created */
+  LagPolicy lag;            /* Adaptive Jacobian and preconditioner lagging */
+  PicardPolicy picard;      /* Picard linearization, then Newton */
+  PetscBool etacache;       /* Residual and Jacobian share the face coefficients cached at each state */
+  PetscBool fastmath;       /* Approximate exp() and pow() in the residual */
+  PetscBool cuda;           /* Residual and Jacobian evaluated on the GPU */
 } AppCtx;
 
+/*
+   Context of the matrix-free Jacobian (-pbratu_jacobian_type shell).  The linearized
+   flux through a face is cn*du_n + ct*du_t, with du_n the difference of du across
+   the face and du_t the sum of differences entering the averaged tangential
+   derivative; cn and ct carry the mesh factors.  The coefficients are cached when
+   the Jacobian is computed, on the x-faces (i+1/2,j), is-1 <= i < ie, and the
+   y-faces (i,j+1/2), js-1 <= j < je, around the owned interior points
+   is <= i < ie, js <= j < je, together with the Bratu term d = -hx hy lambda exp(u).
+   With -pbratu_jacobian_precision single they are stored in the float arrays instead.
+   Unlike -snes_mf, a product needs no residual evaluation, and the coefficients take
+   about half the memory of the AIJ matrix; MatGetDiagonal() makes Jacobi available.
+*/
+typedef struct {
+  DM          dm;
+  PetscInt    is,ie,js,je;
+  PetscScalar *cxn,*cxt;    /* x-face coefficients, row by row, ie-is+1 per row */
+  PetscScalar *cyn,*cyt;    /* y-face coefficients, row by row, ie-is per row */
+  PetscScalar *d;           /* diagonal Bratu term at the owned interior points */
+  float       *scxn,*scxt,*scyn,*scyt,*sd; /* the same in single precision */
+  PetscBool   single;       /* the coefficients are the single precision ones */
+  PetscBool   cuda;         /* the coefficients are device arrays */
+} JacobianShell;
+
+/*
+   Parameter continuation: the sequence of (p,lambda) solved in one run, each solve
+   warm-started from the previous solution
+*/
+#define PBRATU_MAX_CONTINUATION 256
+typedef struct {
+  PetscInt  n;                                 /* number of continuation steps */
+  PetscInt  np,nlambda;                        /* lengths of the p and lambda schedules */
+  PetscReal p[PBRATU_MAX_CONTINUATION];        /* p schedule; the last entry is held when shorter than n */
+  PetscReal lambda[PBRATU_MAX_CONTINUATION];   /* lambda schedule; the last entry is held when shorter than n */
+  PetscBool secant;                            /* extrapolate the initial guess from the last two solutions */
+  PetscInt  start;                             /* first step to solve; after a restart, the step after the checkpointed one */
+  char      checkpoint[PETSC_MAX_PATH_LEN];    /* written after every converged step, unless empty */
+} Continuation;
+
+/*
+   State saved with the solution by WriteCheckpoint(): the grid, the parameters and
+   the continuation step of the solution, and the Newton iterations it took
+*/
+typedef struct {
+  PetscInt  dim,mx,my,mz;
+  PetscReal p,lambda;
+  PetscInt  step,its;
+} CheckpointHeader;
+
+/*
+   Asynchronous solution output (-pbratu_output <prefix>)
+
+   Every `interval' Newton iterations, AsyncOutputMonitor() copies the owned points
+   of the solution whose global indices are multiples of `stride' into a staging
+   buffer, and hands it to a writer thread, so that the solver only pays for the
+   copy.  Each rank writes its part of snapshot n to the raw file
+   <prefix>.<n>.<rank> with
+     PetscInt    11: Newton iteration, snapshot, decimated global size mx,my,mz,
+                     decimated corner xs,ys,zs and extent xm,ym,zm of this part
+     PetscReal    2: p, lambda
+     PetscScalar xm*ym*zm: values, with i fastest and k slowest
+   in native byte order.  If the previous snapshot is still being written on
+   some rank when the next one is due, the new one is skipped on all ranks.
+   Without pthreads the snapshots are written synchronously.
+*/
+#define PBRATU_OUTPUT_NI 11
+typedef struct {
+  char            prefix[PETSC_MAX_PATH_LEN];
+  PetscInt        interval,stride;
+  const AppCtx    *user;
+  MPI_Comm        comm;
+  PetscMPIInt     rank;
+  PetscScalar     *buf;                 /* staging buffer; owned by the writer while busy */
+  PetscInt        capacity;             /* entries of buf */
+  PetscInt        ihdr[PBRATU_OUTPUT_NI];
+  PetscReal       rhdr[2];
+  PetscInt        nsnap,nskipped;       /* snapshots handed to the writer, and skipped */
+  PetscLogDouble  tmonitor;             /* time spent in the monitor */
+  int             failed;               /* errno of a failed write, or 0 */
+#if defined(PETSC_HAVE_PTHREAD)
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             busy,quit;
+#endif
+} AsyncOutput;
+
+/*
+   Solver telemetry (-pbratu_telemetry <file>)
+
+   TelemetryMonitor() adds one record per Newton iteration (including iteration 0 of each
+   solve) to a buffer of `capacity' records allocated by TelemetryCreate(); once it is
+   full, further iterations are only counted as dropped.  The times are differences of
+   the PETSc event counters of the Solve stage since the previous record, so PETSc must
+   be configured with logging (the default).  TelemetryDestroy() takes the largest value
+   over the ranks of each time and of the memory peak, and rank 0 writes all records
+   once, as CSV if the file name ends in .csv and as JSON otherwise.
+*/
+#define PBRATU_TELEMETRY_NE 4                  /* SNESFunctionEval, SNESJacobianEval, PCSetUp, KSPSolve */
+#define PBRATU_TELEMETRY_NV 6
+typedef struct {
+  PetscInt       solve,its,lits;               /* solve, Newton iteration, linear iterations of the step */
+  PetscReal      p,lambda,fnorm;
+  PetscLogDouble v[PBRATU_TELEMETRY_NV];       /* wall time since TelemetryCreate(); residual, Jacobian, PCSetUp()
+                                                  and KSPSolve() (less its PCSetUp()) time of the step; peak resident set */
+} TelemetryRecord;
+typedef struct {
+  char            file[PETSC_MAX_PATH_LEN];
+  PetscInt        capacity;
+  const AppCtx    *user;
+  MPI_Comm        comm;
+  PetscLogStage   stage;                       /* stage of the solves */
+  PetscLogEvent   event[PBRATU_TELEMETRY_NE];
+  PetscLogDouble  t0,last[PBRATU_TELEMETRY_NE];/* creation time, event times at the previous record */
+  PetscInt        lits;                        /* linear iterations of the current solve at the previous record */
+  TelemetryRecord *rec;
+  PetscInt        n,nsolve,ndropped;
+} Telemetry;
+
 /*
    User-defined routines
 */
 static PetscErrorCode FormInitialGuess(DM,Vec);
 static PetscErrorCode FormFunctionLocal(DMDALocalInfo*,PetscScalar**,PetscScalar**,AppCtx*);
+static PetscErrorCode FormFunctionOverlap(SNES,Vec,Vec,void*);
+static PetscErrorCode FormFunctionLocal3d(DMDALocalInfo*,PetscScalar***,PetscScalar***,AppCtx*);
+static PetscErrorCode FormJacobianLocal3d(DMDALocalInfo*,PetscScalar***,Mat,Mat,AppCtx*);
+static PetscErrorCode FormJacobianLocal(DMDALocalInfo*,PetscScalar**,Mat,Mat,AppCtx*);
+static PetscErrorCode AssembleJacobian(DMDALocalInfo*,PetscScalar**,Mat,Mat,AppCtx*,const EtaCache*);
+static PetscErrorCode FormJacobianShellLocal(DMDALocalInfo*,PetscScalar**,Mat,Mat,AppCtx*);
+static PetscErrorCode FormJacobianPicardLocal(DMDALocalInfo*,PetscScalar**,Mat,Mat,AppCtx*);
+static PetscErrorCode AssemblePicard(DMDALocalInfo*,PetscScalar**,Mat,Mat,AppCtx*,const EtaCache*);
+static PetscErrorCode FormFunctionCached(SNES,Vec,Vec,void*);
+static PetscErrorCode FormJacobianCached(SNES,Vec,Mat,Mat,void*);
+static PetscErrorCode PicardMonitor(SNES,PetscInt,PetscReal,void*);
+static PetscErrorCode FormJacobianColoring(SNES,Vec,Mat,Mat,void*);
+static PetscErrorCode NonlinearGS(SNES,Vec,Vec,void*);
+static PetscErrorCode LagUpdate(SNES,PetscInt);
+static PetscErrorCode SetUpJacobianShell(SNES,AppCtx*);
+#if defined(PBRATU_HAVE_CUDA)
+static PetscErrorCode FormFunctionCUDA(SNES,Vec,Vec,void*);
+static PetscErrorCode FormJacobianCUDA(SNES,Vec,Mat,Mat,void*);
+#endif
+static PetscErrorCode CoarsenHook_PBratu(DM,DM,void*);
+static PetscErrorCode RestrictHook_PBratu(DM,Mat,Vec,Mat,DM,void*);
+static PetscErrorCode SetUpMultigridRestriction(SNES,AppCtx*);
+static PetscErrorCode SolveGridSequence(SNES,PetscInt,DM*,Vec*,AppCtx*);
+static PetscErrorCode SolveContinuation(SNES,PetscInt,DM*,Vec*,AppCtx*,Continuation*);
+static PetscErrorCode BenchmarkResidual(DM,Vec,AppCtx*,PetscInt,PetscReal);
+static PetscErrorCode ComparePrecision(SNES,Vec,AppCtx*);
+static PetscErrorCode CompareFastMath(SNES,Vec,AppCtx*);
+static PetscErrorCode SolveEnsemble(SNES,Vec,AppCtx*,const char[]);
+static PetscErrorCode SolveServer(SNES,DM*,Vec*,AppCtx*,const char[],PBratuPartitionType);
+static PetscErrorCode WriteCheckpoint(const char[],Vec,const AppCtx*,PetscInt,PetscInt);
+static PetscErrorCode ReadCheckpoint(const char[],Vec,CheckpointHeader*);
+static PetscErrorCode AsyncOutputCreate(SNES,const AppCtx*,AsyncOutput*);
+static PetscErrorCode AsyncOutputDestroy(AsyncOutput*);
+static PetscErrorCode TelemetryCreate(SNES,const AppCtx*,PetscLogStage,Telemetry*);
+static PetscErrorCode TelemetryDestroy(Telemetry*);
+static PetscErrorCode MemoryReport(MPI_Comm);
+static PetscErrorCode SetUpPartition(DM);
+static PetscErrorCode PartitionReport(DM);
+
+/*
+   Logging of the user-defined routines
+*/
+static PetscLogEvent ResidualEvent,InitialGuessEvent,JacobianEvent,NGSEvent,EtaComputeEvent,EtaReuseEvent;
+
+/*
+   eta - nonlinear diffusivity of the p-Laplacian evaluated from the gradient (ux,uy) on a cell face
+   deta - derivative of eta with respect to gamma = 1/2 |grad u|^2
+*/
+PETSC_STATIC_INLINE PetscScalar eta(const AppCtx *ctx,PetscScalar ux,PetscScalar uy)
+{
+  return PetscPowScalar(PetscSqr(ctx->epsilon)+0.5*(ux*ux + uy*uy),0.5*(ctx->p-2.));
+}
+PETSC_STATIC_INLINE PetscScalar deta(const AppCtx *ctx,PetscScalar ux,PetscScalar uy)
+{
+  return (ctx->p == 2)
+         ? 0
+         : PetscPowScalar(PetscSqr(ctx->epsilon)+0.5*(ux*ux + uy*uy),0.5*(ctx->p-4)) * 0.5 * (ctx->p-2.);
+}
+
+#if defined(PBRATU_HAVE_FASTMATH)
+/*
+   FastExp - exp(x) by x = n log(2) + r, |r| <= log(2)/2, and the Taylor polynomial of degree 10
+             of exp(r), scaled by 2^n built in the exponent bits; x is clamped to [-708,709]
+   FastLog - log(x) by x = 2^e m, sqrt(1/2) <= m < sqrt(2), and the series of
+             log(m) = 2 atanh((m-1)/(m+1)) to degree 13; x is clamped to at least DBL_MIN
+   FastPow - x^y = exp(y log(x)), x > 0
+
+   All are free of branches and table lookups, and of conversions between doubles and
+   64-bit integers, so they vectorize in PBRATU_PRAGMA_OMP_SIMD loops: the clamps multiply
+   by comparisons and FastLog() reduces m with an integer carry, as a floating point ?:
+   is a branch for compilers that honor trapping math.  Measured over
+   the whole range, the relative error of FastExp() is about 3e-13, the absolute
+   error of FastLog() about 5e-13, so that of FastPow() is about 3e-13 + 5e-13 |y|.
+   With -pbratu_fastmath every residual kernel uses them, while the Jacobians and the
+   NGS smoother keep the math library: Newton converges to the solution of the
+   approximate residual, whose norm stalls near the approximation error.
+*/
+PETSC_STATIC_INLINE double FastExp(double x)
+{
+  const double shift = 6755399441055744.0;    /* 1.5*2^52: t = x log2(e) + shift rounds to an integer n */
+  const double ln2hi = 6.93147180369123816490e-01,ln2lo = 1.90821492927058770002e-10;
+  double       t,n,r,e,s;
+  uint64_t     b;
+
+  x = x + (double)(x < -708.0)*(-708.0 - x);
+  x = x + (double)(x > 709.0)*(709.0 - x);
+  t = x*1.44269504088896340736 + shift;
+  n = t - shift;
+  r = (x - n*ln2hi) - n*ln2lo;
+  e = 1 + r*(1 + r*(1./2 + r*(1./6 + r*(1./24 + r*(1./120 + r*(1./720 + r*(1./5040 + r*(1./40320 + r*(1./362880 + r*(1./3628800))))))))));
+  memcpy(&b,&t,sizeof(b));
+  b = (b + 1023) << 52;                       /* the low bits of t hold n */
+  memcpy(&s,&b,sizeof(s));
+  return e*s;
+}
+PETSC_STATIC_INLINE double FastLog(double x)
+{
+  const double ln2hi = 6.93147180369123816490e-01,ln2lo = 1.90821492927058770002e-10;
+  double       m,e,z,z2;
+  uint64_t     b,f,c,be;
+
+  x  = x + (double)(x < 2.2250738585072014e-308)*(2.2250738585072014e-308 - x);
+  memcpy(&b,&x,sizeof(b));
+  f  = b & UINT64_C(0x000FFFFFFFFFFFFF);
+  c  = (f + UINT64_C(0x00095F619980C433)) >> 52;                          /* 1 if 1.f >= sqrt(2) */
+  be = UINT64_C(0x4330000000000000) | ((b >> 52) + c);                    /* 2^52 + biased exponent */
+  b  = f | ((UINT64_C(0x3FF) - c) << 52);                                 /* m = 1.f or 1.f/2 */
+  memcpy(&e,&be,sizeof(e));
+  memcpy(&m,&b,sizeof(m));
+  e  = e - (4503599627370496.0 + 1023);
+  z  = (m - 1)/(m + 1);
+  z2 = z*z;
+  return e*ln2hi + (e*ln2lo + 2*z*(1 + z2*(1./3 + z2*(1./5 + z2*(1./7 + z2*(1./9 + z2*(1./11 + z2*(1./13))))))));
+}
+PETSC_STATIC_INLINE double FastPow(double x,double y)
+{
+  return FastExp(y*FastLog(x));
+}
+#endif
+
+/*
+   Loops annotated with PBRATU_PRAGMA_OMP_SIMD are unit-stride and free of branches
+   and loop-carried dependencies, so they vectorize; the pragma is honored when
+   building with OpenMP or with -fopenmp-simd (make PBRATU_OMP_SIMD=1).
+*/
+#if defined(_OPENMP) || defined(PBRATU_OMP_SIMD)
+#define PBRATU_PRAGMA_OMP_SIMD _Pragma("omp simd")
+#else
+#define PBRATU_PRAGMA_OMP_SIMD
+#endif
+
+/*
+   The residual kernels call exp() and pow() through loops that exist in two versions,
+   with the approximations of -pbratu_fastmath and with the math library, as compilers
+   do not reliably take the loop-invariant test out of a loop themselves.
+
+   BratuRow - f[k] -= sc exp(x[k]), 0 <= k < n
+   PowRow   - f[k] *= g[k]^q, 0 <= k < n
+*/
+static void BratuRow(const AppCtx *ctx,PetscInt n,PetscReal sc,const PetscScalar *PETSC_RESTRICT x,PetscScalar *PETSC_RESTRICT f)
+{
+  PetscInt k;
+
+#if defined(PBRATU_HAVE_FASTMATH)
+  if (ctx->fastmath) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) f[k] -= sc*FastExp(x[k]);
+    return;
+  }
+#endif
+  PBRATU_PRAGMA_OMP_SIMD
+  for (k=0; k<n; k++) f[k] -= sc*PetscExpScalar(x[k]);
+}
+static void PowRow(const AppCtx *ctx,PetscInt n,PetscReal q,const PetscScalar *PETSC_RESTRICT g,PetscScalar *PETSC_RESTRICT f)
+{
+  PetscInt k;
+
+#if defined(PBRATU_HAVE_FASTMATH)
+  if (ctx->fastmath) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) f[k] *= FastPow(g[k],q);
+    return;
+  }
+#endif
+  for (k=0; k<n; k++) f[k] *= PetscPowScalar(g[k],q);
+}
+
+/*
+   FluxXRow - diffusive fluxes eta*ux through the n faces (i+1/2,j), i = i0..i0+n-1,
+              between x[j][i] and x[j][i+1]
+   FluxYRow - diffusive fluxes eta*uy through the n faces (i,j+1/2), i = i0..i0+n-1,
+              between x[j][i] and x[j+1][i]
+
+   The row pointers xs, xc, xn are x[j-1]+i0, x[j]+i0, x[j+1]+i0.  The tangential
+   derivative is averaged over the four points adjacent to the face.
+*/
+static void FluxXRow(const AppCtx *ctx,const PetscScalar *PETSC_RESTRICT xs,const PetscScalar *PETSC_RESTRICT xc,const PetscScalar *PETSC_RESTRICT xn,
+                     PetscInt n,PetscReal dhx,PetscReal dhy,PetscScalar *PETSC_RESTRICT fx)
+{
+  const PetscReal e2 = PetscSqr(ctx->epsilon),q = 0.5*(ctx->p-2.);
+  PetscInt        k;
+
+#if defined(PBRATU_HAVE_FASTMATH)
+  if (ctx->fastmath) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) {
+      const PetscScalar
+        ux = dhx*(xc[k+1]-xc[k]),
+        uy = 0.25*dhy*(xn[k]+xn[k+1]-xs[k]-xs[k+1]);
+      fx[k] = FastPow(e2+0.5*(ux*ux + uy*uy),q)*ux;
+    }
+    return;
+  }
+#endif
+  PBRATU_PRAGMA_OMP_SIMD
+  for (k=0; k<n; k++) {
+    const PetscScalar
+      ux = dhx*(xc[k+1]-xc[k]),
+      uy = 0.25*dhy*(xn[k]+xn[k+1]-xs[k]-xs[k+1]);
+    fx[k] = PetscPowScalar(e2+0.5*(ux*ux + uy*uy),q)*ux;
+  }
+}
+static void FluxYRow(const AppCtx *ctx,const PetscScalar *PETSC_RESTRICT xc,const PetscScalar *PETSC_RESTRICT xn,
+                     PetscInt n,PetscReal dhx,PetscReal dhy,PetscScalar *PETSC_RESTRICT fy)
+{
+  const PetscReal e2 = PetscSqr(ctx->epsilon),q = 0.5*(ctx->p-2.);
+  PetscInt        k;
+
+#if defined(PBRATU_HAVE_FASTMATH)
+  if (ctx->fastmath) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) {
+      const PetscScalar
+        ux = 0.25*dhx*(xc[k+1]+xn[k+1]-xc[k-1]-xn[k-1]),
+        uy = dhy*(xn[k]-xc[k]);
+      fy[k] = FastPow(e2+0.5*(ux*ux + uy*uy),q)*uy;
+    }
+    return;
+  }
+#endif
+  PBRATU_PRAGMA_OMP_SIMD
+  for (k=0; k<n; k++) {
+    const PetscScalar
+      ux = 0.25*dhx*(xc[k+1]+xn[k+1]-xc[k-1]-xn[k-1]),
+      uy = dhy*(xn[k]-xc[k]);
+    fy[k] = PetscPowScalar(e2+0.5*(ux*ux + uy*uy),q)*uy;
+  }
+}
+
+/*
+   The boundary condition of each direction of the 2D grid is given by the boundary type of
+   the DMDA: homogeneous Dirichlet for DM_BOUNDARY_NONE, periodic for DM_BOUNDARY_PERIODIC,
+   and homogeneous Neumann for DM_BOUNDARY_GHOSTED, whose ghost points across the side are
+   set by MirrorGhosts() to the mirror images of the first interior points.  The stencil
+   kernels are thus the same for all of them, on different ranges of points: only the
+   points of Dirichlet sides are left out, and get their own loops in BoundaryRows().
+
+   GridSpacing   - spacing of the m points of a direction, periodic ones with period m points
+   InteriorRange - the points is <= i < ie among s <= i < e that are not on a Dirichlet side
+*/
+PETSC_STATIC_INLINE PetscReal GridSpacing(PetscInt m,DMBoundaryType bt)
+{
+  return 1./(PetscReal)(bt == DM_BOUNDARY_PERIODIC ? m : m-1);
+}
+PETSC_STATIC_INLINE void InteriorRange(PetscInt s,PetscInt e,PetscInt m,DMBoundaryType bt,PetscInt *is,PetscInt *ie)
+{
+  if (bt == DM_BOUNDARY_NONE) {
+    *is = PetscMax(s,1); *ie = PetscMin(e,m-1);
+  } else {
+    *is = s; *ie = e;
+  }
+}
+
+/*
+   ResidualBlock_Scalar - Evaluates the residual at the interior points is <= i < ie, js <= j < je.
+
+   The block only reads x[js-1..je][is-1..ie], so any block of interior points may
+   be evaluated independently.  Every face flux is computed once, into the work
+   array fx (x-faces of the current row) and the two row buffers fyS and fyN
+   (y-faces below and above the current row), which are swapped from row to row.
+   work must hold PBRATU_BLOCK_WORK(ie-is) entries.  For p = 2 the diffusivity is
+   identically one and the 5-point Laplacian is evaluated directly.
+
+   This is the reference implementation; see ResidualBlock_SIMD() for the
+   explicitly vectorized one.
+*/
+#define PBRATU_BLOCK_WORK(n) (5*(n)+2)
+static void ResidualBlock_Scalar(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,PetscScalar **f,
+                          PetscInt is,PetscInt ie,PetscInt js,PetscInt je,PetscScalar *work)
+{
+  const PetscReal hx = GridSpacing(info->mx,info->bx),hy = GridSpacing(info->my,info->by);
+  const PetscReal sc = hx*hy*user->lambda,dhx = 1/hx,dhy = 1/hy,hxdhy = hx/hy,hydhx = hy/hx;
+  const PetscInt  n  = ie-is;
+  PetscInt        j,k;
+
+  if (user->p == 2) {
+    for (j=js; j<je; j++) {
+      const PetscScalar *PETSC_RESTRICT xs = x[j-1]+is,*PETSC_RESTRICT xc = x[j]+is,*PETSC_RESTRICT xn = x[j+1]+is;
+      PetscScalar       *PETSC_RESTRICT fr = f[j]+is;
+
+      PBRATU_PRAGMA_OMP_SIMD
+      for (k=0; k<n; k++) {
+        fr[k] = (2.0*xc[k] - xc[k-1] - xc[k+1])*hydhx + (2.0*xc[k] - xs[k] - xn[k])*hxdhy;
+      }
+      if (sc) BratuRow(user,n,sc,xc,fr);
+    }
+  } else {
+    PetscScalar *fx = work,*fyS = work+n+1,*fyN = work+2*n+1,*tmp;
+
+    FluxYRow(user,x[js-1]+is,x[js]+is,n,dhx,dhy,fyS);
+    for (j=js; j<je; j++) {
+      const PetscScalar *PETSC_RESTRICT xc = x[j]+is;
+      PetscScalar       *PETSC_RESTRICT fr = f[j]+is;
+
+      FluxXRow(user,x[j-1]+is-1,x[j]+is-1,x[j+1]+is-1,n+1,dhx,dhy,fx);
+      FluxYRow(user,x[j]+is,x[j+1]+is,n,dhx,dhy,fyN);
+      PBRATU_PRAGMA_OMP_SIMD
+      for (k=0; k<n; k++) {
+        fr[k] = -hy*(fx[k+1] - fx[k]) - hx*(fyN[k] - fyS[k]);
+      }
+      if (sc) BratuRow(user,n,sc,xc,fr);
+      tmp = fyS; fyS = fyN; fyN = tmp;
+    }
+  }
+}
+
+#if defined(PBRATU_HAVE_SIMD)
+/*
+   Thin wrappers over the intrinsics of the selected instruction set; VFMA(a,b,c) = a*b + c
+*/
+#if defined(PBRATU_SIMD_AVX512)
+#define PBRATU_VLEN 8
+typedef __m512d PBratuVec;
+#define VLOAD(p)     _mm512_loadu_pd(p)
+#define VSTORE(p,a)  _mm512_storeu_pd(p,a)
+#define VSET1(a)     _mm512_set1_pd(a)
+#define VADD(a,b)    _mm512_add_pd(a,b)
+#define VSUB(a,b)    _mm512_sub_pd(a,b)
+#define VMUL(a,b)    _mm512_mul_pd(a,b)
+#define VFMA(a,b,c)  _mm512_fmadd_pd(a,b,c)
+#elif defined(PBRATU_SIMD_AVX2)
+#define PBRATU_VLEN 4
+typedef __m256d PBratuVec;
+#define VLOAD(p)     _mm256_loadu_pd(p)
+#define VSTORE(p,a)  _mm256_storeu_pd(p,a)
+#define VSET1(a)     _mm256_set1_pd(a)
+#define VADD(a,b)    _mm256_add_pd(a,b)
+#define VSUB(a,b)    _mm256_sub_pd(a,b)
+#define VMUL(a,b)    _mm256_mul_pd(a,b)
+#define VFMA(a,b,c)  _mm256_fmadd_pd(a,b,c)
+#else
+#define PBRATU_VLEN 2
+typedef float64x2_t PBratuVec;
+#define VLOAD(p)     vld1q_f64(p)
+#define VSTORE(p,a)  vst1q_f64(p,a)
+#define VSET1(a)     vdupq_n_f64(a)
+#define VADD(a,b)    vaddq_f64(a,b)
+#define VSUB(a,b)    vsubq_f64(a,b)
+#define VMUL(a,b)    vmulq_f64(a,b)
+#define VFMA(a,b,c)  vfmaq_f64(c,a,b)
+#endif
+
+/*
+   ResidualBlock_SIMD - Same as ResidualBlock_Scalar(), with the stencil arithmetic in intrinsics
+
+   Each row is processed as contiguous spans of x[j-1], x[j], x[j+1]; the shifted
+   neighbors x[j][i-1] and x[j][i+1] are unaligned loads from the same row.  There
+   is no vector pow() or exp(), so for p != 2 the gradients and gamma are computed
+   in vector registers, eta is applied by a scalar pass over the face rows, and the
+   Bratu term stays scalar.
+*/
+static void ResidualBlock_SIMD(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,PetscScalar **f,
+                               PetscInt is,PetscInt ie,PetscInt js,PetscInt je,PetscScalar *work)
+{
+  const PetscReal hx = GridSpacing(info->mx,info->bx),hy = GridSpacing(info->my,info->by);
+  const PetscReal sc = hx*hy*user->lambda,dhx = 1/hx,dhy = 1/hy,hxdhy = hx/hy,hydhx = hy/hx;
+  const PetscInt  n  = ie-is;
+  PetscInt        j,k;
+
+  if (user->p == 2) {
+    const PBratuVec two = VSET1(2.0),vhydhx = VSET1(hydhx),vhxdhy = VSET1(hxdhy);
+
+    for (j=js; j<je; j++) {
+      const PetscScalar *xs = x[j-1]+is,*xc = x[j]+is,*xn = x[j+1]+is;
+      PetscScalar       *fr = f[j]+is;
+
+      for (k=0; k+PBRATU_VLEN<=n; k+=PBRATU_VLEN) {
+        const PBratuVec u   = VLOAD(xc+k),
+                        uxx = VSUB(VMUL(two,u),VADD(VLOAD(xc+k-1),VLOAD(xc+k+1))),
+                        uyy = VSUB(VMUL(two,u),VADD(VLOAD(xs+k),VLOAD(xn+k)));
+        VSTORE(fr+k,VFMA(uyy,vhxdhy,VMUL(uxx,vhydhx)));
+      }
+      for (; k<n; k++) {
+        fr[k] = (2.0*xc[k] - xc[k-1] - xc[k+1])*hydhx + (2.0*xc[k] - xs[k] - xn[k])*hxdhy;
+      }
+      if (sc) BratuRow(user,n,sc,xc,fr);
+    }
+  } else {
+    const PetscReal e2 = PetscSqr(user->epsilon),q = 0.5*(user->p-2.);
+    const PBratuVec ve2 = VSET1(e2),half = VSET1(0.5),vdhx = VSET1(dhx),vdhy = VSET1(dhy),
+                    vqdhx = VSET1(0.25*dhx),vqdhy = VSET1(0.25*dhy),vmhx = VSET1(-hx),vmhy = VSET1(-hy);
+    PetscScalar     *fx = work,*gx = work+n+1,*fyS = work+2*n+2,*fyN = work+3*n+2,*gy = work+4*n+2,*tmp;
+    PetscInt        row;
+
+    /* row = 0 fills the south faces of the first row into fyS; afterwards each row fills its north faces */
+    for (row=0,j=js-1; j<je; j++,row++) {
+      const PetscScalar *xc = x[j]+is,*xn = x[j+1]+is;
+      PetscScalar       *fy = row ? fyN : fyS;
+
+      for (k=0; k+PBRATU_VLEN<=n; k+=PBRATU_VLEN) {
+        const PBratuVec ux = VMUL(vqdhx,VSUB(VADD(VLOAD(xc+k+1),VLOAD(xn+k+1)),VADD(VLOAD(xc+k-1),VLOAD(xn+k-1)))),
+                        uy = VMUL(vdhy,VSUB(VLOAD(xn+k),VLOAD(xc+k)));
+        VSTORE(fy+k,uy);
+        VSTORE(gy+k,VFMA(half,VFMA(ux,ux,VMUL(uy,uy)),ve2));
+      }
+      for (; k<n; k++) {
+        const PetscScalar
+          ux = 0.25*dhx*(xc[k+1]+xn[k+1]-xc[k-1]-xn[k-1]),
+          uy = dhy*(xn[k]-xc[k]);
+        fy[k] = uy;
+        gy[k] = e2+0.5*(ux*ux + uy*uy);
+      }
+      PowRow(user,n,q,gy,fy);
+      if (!row) continue;
+
+      {
+        const PetscScalar *xw = x[j]+is-1,*xsw = x[j-1]+is-1,*xnw = x[j+1]+is-1;
+        PetscScalar       *fr = f[j]+is;
+
+        for (k=0; k+PBRATU_VLEN<=n+1; k+=PBRATU_VLEN) {
+          const PBratuVec ux = VMUL(vdhx,VSUB(VLOAD(xw+k+1),VLOAD(xw+k))),
+                          uy = VMUL(vqdhy,VSUB(VADD(VLOAD(xnw+k),VLOAD(xnw+k+1)),VADD(VLOAD(xsw+k),VLOAD(xsw+k+1))));
+          VSTORE(fx+k,ux);
+          VSTORE(gx+k,VFMA(half,VFMA(ux,ux,VMUL(uy,uy)),ve2));
+        }
+        for (; k<n+1; k++) {
+          const PetscScalar
+            ux = dhx*(xw[k+1]-xw[k]),
+            uy = 0.25*dhy*(xnw[k]+xnw[k+1]-xsw[k]-xsw[k+1]);
+          fx[k] = ux;
+          gx[k] = e2+0.5*(ux*ux + uy*uy);
+        }
+        PowRow(user,n+1,q,gx,fx);
+
+        for (k=0; k+PBRATU_VLEN<=n; k+=PBRATU_VLEN) {
+          const PBratuVec dfx = VSUB(VLOAD(fx+k+1),VLOAD(fx+k)),
+                          dfy = VSUB(VLOAD(fyN+k),VLOAD(fyS+k));
+          VSTORE(fr+k,VFMA(vmhx,dfy,VMUL(vmhy,dfx)));
+        }
+        for (; k<n; k++) {
+          fr[k] = -hy*(fx[k+1] - fx[k]) - hx*(fyN[k] - fyS[k]);
+        }
+        if (sc) BratuRow(user,n,sc,xw+1,fr);
+      }
+      tmp = fyS; fyS = fyN; fyN = tmp;
+    }
+  }
+}
+#endif
+
+/*
+   ResidualBlock - Evaluates the interior residual on a block with the kernel selected by -pbratu_kernel
+*/
+PETSC_STATIC_INLINE void ResidualBlock(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,PetscScalar **f,
+                                       PetscInt is,PetscInt ie,PetscInt js,PetscInt je,PetscScalar *work)
+{
+#if defined(PBRATU_HAVE_SIMD)
+  if (user->kernel == PBRATU_KERNEL_SIMD) {
+    ResidualBlock_SIMD(info,user,x,f,is,ie,js,je,work);
+    return;
+  }
+#endif
+  ResidualBlock_Scalar(info,user,x,f,is,ie,js,je,work);
+}
 
 #undef __FUNCT__
 #define __FUNCT__ "main"
@@ -68,10 +822,35 @@ int main(int argc,char **argv)
 {
   SNES                   snes;                 /* nonlinear solver */
   Vec                    x,r;                  /* solution, residual vectors */
+  PetscBool              memreport;            /* print the peak memory usage of each rank */
+  PetscBool              overlap;              /* overlap the ghost point exchange with the residual */
+  PetscBool              compare;              /* compare the solves with double and single precision Jacobians */
+  PetscBool              fastcompare;          /* compare the solves with the math library and with approximate exp() and pow() */
+  PetscInt               dim;                  /* spatial dimension */
+  PBratuPartitionType    partition;            /* choice of the process grid */
+  PetscBool              partreport;           /* print the owned and ghost points of each rank */
+  PBratuBCType           bc[2];                /* boundary conditions in x and y */
+  char                   restart[PETSC_MAX_PATH_LEN]; /* checkpoint to start from, unless empty */
+  CheckpointHeader       hdr;
+  AsyncOutput            output;               /* decimated solution output, if output.prefix is not empty */
+  Telemetry              telemetry;            /* records of each Newton iteration, if telemetry.file is not empty */
+  char                   ensemble[PETSC_MAX_PATH_LEN]; /* file of (p,lambda) instances to solve, unless empty */
+  PetscInt               esize;                /* ranks per ensemble instance */
+  char                   server[PETSC_MAX_PATH_LEN]; /* file of requests to solve in turn (- for stdin), unless empty */
+  PetscMPIInt            rank,size;
+  MPI_Comm               comm;                 /* communicator of the DMDA and SNES */
   AppCtx                 user;                 /* user-defined work context */
+  Continuation           cont;                 /* parameter continuation schedule */
   DM                     dm;
   PetscInt               its;                  /* iterations for convergence */
+  PetscInt               nseq;                 /* number of grid sequencing refinements */
+  PetscInt               ntile;
+  PetscBool              flg;
   SNESConvergedReason    reason;               /* Check convergence */
+  PetscInt               nbench;               /* number of residual evaluations of -pbratu_bench */
+  PetscReal              streambw;             /* STREAM bandwidth (GB/s) the benchmark is compared to */
+  PetscClassId           classid;
+  PetscLogStage          stages[3];
   PetscErrorCode         ierr;
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -80,18 +859,192 @@ int main(int argc,char **argv)
 
   PetscInitialize(&argc,&argv,0,help);
 
+  ierr = PetscClassIdRegister("p-Bratu",&classid);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuResidual",classid,&ResidualEvent);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuInitGuess",classid,&InitialGuessEvent);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuJacobian",classid,&JacobianEvent);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuNGS",classid,&NGSEvent);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuEtaCompute",classid,&EtaComputeEvent);CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("PBratuEtaReuse",classid,&EtaReuseEvent);CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Setup",&stages[0]);CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Solve",&stages[1]);CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Teardown",&stages[2]);CHKERRQ(ierr);
+  ierr = PetscLogStagePush(stages[0]);CHKERRQ(ierr);
+
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Initialize problem parameters
+  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  user.lambda  = 0.0;
+  user.p       = 2.0;
+  user.epsilon = 1e-5;
+  user.kernel  = PBRATU_KERNEL_SCALAR;
+  user.tile[0] = 0;
+  user.tile[1] = 0;
+  user.mgrestrict = PBRATU_RESTRICT_RESTRICT;
+  user.jtype   = PBRATU_JACOBIAN_AIJ;
+  user.jprecision = PBRATU_PRECISION_DOUBLE;
+  user.ncolors = 0;
+  ierr = PetscMemzero(&user.lag,sizeof(user.lag));CHKERRQ(ierr);
+  user.lag.itsratio = 2.0;
+  user.lag.stall    = 0.5;
+  ierr = PetscMemzero(&user.picard,sizeof(user.picard));CHKERRQ(ierr);
+  user.picard.rtol  = 1e-2;
+  user.etacache     = PETSC_FALSE;
+  user.fastmath     = PETSC_FALSE;
+  user.cuda    = PETSC_FALSE;
+  nbench       = 0;
+  streambw     = 0;
+  memreport    = PETSC_FALSE;
+  overlap      = PETSC_FALSE;
+  compare      = PETSC_FALSE;
+  fastcompare  = PETSC_FALSE;
+  dim          = 2;
+  partition    = PBRATU_PARTITION_PETSC;
+  partreport   = PETSC_FALSE;
+  bc[0]        = PBRATU_BC_DIRICHLET;
+  bc[1]        = PBRATU_BC_DIRICHLET;
+  ierr = PetscOptionsBegin(PETSC_COMM_WORLD,NULL,"p-Bratu options",__FILE__);CHKERRQ(ierr);
+  {
+    ierr = PetscOptionsReal("-lambda","Bratu parameter","",user.lambda,&user.lambda,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-p","Exponent `p' in p-Laplacian","",user.p,&user.p,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-epsilon","Strain-regularization in p-Laplacian","",user.epsilon,&user.epsilon,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_dim","Spatial dimension, 2 or 3","",dim,&dim,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_partition","Choice of the process grid","",PBratuPartitionTypes,(PetscEnum)partition,(PetscEnum*)&partition,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_bc","Boundary condition on all sides","",PBratuBCTypes,(PetscEnum)bc[0],(PetscEnum*)&bc[0],&flg);CHKERRQ(ierr);
+    if (flg) bc[1] = bc[0];
+    ierr = PetscOptionsEnum("-pbratu_bc_x","Boundary condition on the sides x = 0 and x = 1","",PBratuBCTypes,(PetscEnum)bc[0],(PetscEnum*)&bc[0],NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_bc_y","Boundary condition on the sides y = 0 and y = 1","",PBratuBCTypes,(PetscEnum)bc[1],(PetscEnum*)&bc[1],NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_partition_report","Print the owned and ghost points of each rank","",partreport,&partreport,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_kernel","Implementation of the interior residual kernel","",PBratuKernelTypes,(PetscEnum)user.kernel,(PetscEnum*)&user.kernel,NULL);CHKERRQ(ierr);
+    ntile = 2;
+    ierr = PetscOptionsIntArray("-pbratu_tile","Tile size <tx,ty> of the interior residual traversal (0: untiled)","",user.tile,&ntile,&flg);CHKERRQ(ierr);
+    if (flg && ntile == 1) user.tile[1] = user.tile[0];
+    ierr = PetscOptionsEnum("-pbratu_mg_restrict","Transfer of the state to coarse multigrid levels","",PBratuRestrictTypes,(PetscEnum)user.mgrestrict,(PetscEnum*)&user.mgrestrict,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_jacobian_type","Assembled (aij), matrix-free (shell) or finite-difference (fd) Newton Jacobian","",PBratuJacobianTypes,(PetscEnum)user.jtype,(PetscEnum*)&user.jtype,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsEnum("-pbratu_jacobian_precision","Precision of the matrix-free Jacobian coefficients","",PBratuPrecisionTypes,(PetscEnum)user.jprecision,(PetscEnum*)&user.jprecision,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_precision_compare","Compare the solves with double and single precision matrix-free Jacobians","",compare,&compare,NULL);CHKERRQ(ierr);
+    cont.np      = PBRATU_MAX_CONTINUATION;
+    cont.nlambda = PBRATU_MAX_CONTINUATION;
+    cont.secant  = PETSC_FALSE;
+    ierr = PetscOptionsRealArray("-pbratu_p_schedule","Continuation schedule <p0,p1,...> for p","",cont.p,&cont.np,&flg);CHKERRQ(ierr);
+    if (!flg) cont.np = 0;
+    ierr = PetscOptionsRealArray("-pbratu_lambda_schedule","Continuation schedule <lambda0,lambda1,...> for lambda","",cont.lambda,&cont.nlambda,&flg);CHKERRQ(ierr);
+    if (!flg) cont.nlambda = 0;
+    ierr = PetscOptionsBool("-pbratu_continuation_secant","Secant predictor for the initial guess of each continuation step","",cont.secant,&cont.secant,NULL);CHKERRQ(ierr);
+    cont.start         = 0;
+    cont.checkpoint[0] = 0;
+    restart[0]         = 0;
+    output.prefix[0]   = 0;
+    output.interval    = 1;
+    output.stride      = 1;
+    ensemble[0]        = 0;
+    esize              = 1;
+    server[0]          = 0;
+    telemetry.file[0]  = 0;
+    telemetry.capacity = 4096;
+    ierr = PetscOptionsString("-pbratu_checkpoint","Save the solution after every converged continuation step","",cont.checkpoint,cont.checkpoint,sizeof(cont.checkpoint),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsString("-pbratu_restart","Start from the solution of a checkpoint","",restart,restart,sizeof(restart),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsString("-pbratu_output","Write the solution in the background to files <prefix>.<snapshot>.<rank>","",output.prefix,output.prefix,sizeof(output.prefix),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_output_interval","Newton iterations between solution snapshots","",output.interval,&output.interval,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_output_stride","Keep the grid points whose indices are multiples of this","",output.stride,&output.stride,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsString("-pbratu_telemetry","Write the residual norm, iterations, times and memory of every Newton iteration to this file at the end","",telemetry.file,telemetry.file,sizeof(telemetry.file),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_telemetry_size","Newton iterations the telemetry buffer holds","",telemetry.capacity,&telemetry.capacity,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsString("-pbratu_ensemble","Solve each (p,lambda) line of this file","",ensemble,ensemble,sizeof(ensemble),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_ensemble_size","Ranks per ensemble instance","",esize,&esize,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsString("-pbratu_server","Solve the request of each line of this file (- for standard input)","",server,server,sizeof(server),NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsInt("-pbratu_bench","Instead of solving, time this many evaluations of the residual kernel","",nbench,&nbench,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-pbratu_stream_bw","STREAM bandwidth (GB/s) the residual benchmark is compared to","",streambw,&streambw,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_lag","Rebuild the Jacobian and preconditioner only when the solver slows down","",user.lag.on,&user.lag.on,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-pbratu_lag_its_ratio","Rebuild both when the linear iterations grow by more than this factor","",user.lag.itsratio,&user.lag.itsratio,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-pbratu_lag_stall","Rebuild the Jacobian when a Newton step reduces ||F|| by less than this factor","",user.lag.stall,&user.lag.stall,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_picard","Linearize with the frozen-coefficient (Picard) operator","",user.picard.on,&user.picard.on,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsReal("-pbratu_picard_switch_rtol","Switch from Picard to Newton once ||F|| is reduced by this factor (0: never)","",user.picard.rtol,&user.picard.rtol,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_eta_cache","Share the face coefficients between residual and Jacobian evaluations at the same state","",user.etacache,&user.etacache,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_fastmath","Approximate exp() and pow() in the residual kernels","",user.fastmath,&user.fastmath,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_fastmath_compare","Compare the solves with the math library and with -pbratu_fastmath","",fastcompare,&fastcompare,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_overlap","Overlap the ghost point exchange with the residual evaluation","",overlap,&overlap,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsBool("-pbratu_memory_report","Print the peak memory usage of each rank","",memreport,&memreport,NULL);CHKERRQ(ierr);
+  }
+  ierr = PetscOptionsEnd();CHKERRQ(ierr);
+  if (memreport || telemetry.file[0]) {ierr = PetscMemorySetGetMaximumUsage();CHKERRQ(ierr);}
+  if (telemetry.file[0]) {ierr = PetscLogDefaultBegin();CHKERRQ(ierr);}
+  if (!cont.np)      {cont.p[0]      = user.p;      cont.np      = 1;}
+  if (!cont.nlambda) {cont.lambda[0] = user.lambda; cont.nlambda = 1;}
+  cont.n      = PetscMax(cont.np,cont.nlambda);
+
+  user.p      = cont.p[0];
+  user.lambda = cont.lambda[0];
+  for (its=0; its<cont.n; its++) {
+    if (cont.lambda[PetscMin(its,cont.nlambda-1)] < 0) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"Lambda must be nonnegative");
+    if (cont.p[PetscMin(its,cont.np-1)] < 1) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"p must be at least 1");
+  }
+  if (user.tile[0] < 0 || user.tile[1] < 0) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"Tile sizes must be nonnegative");
+  if (compare) user.jtype = PBRATU_JACOBIAN_SHELL;
+  if (user.jprecision == PBRATU_PRECISION_SINGLE && user.jtype != PBRATU_JACOBIAN_SHELL) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_jacobian_precision single requires -pbratu_jacobian_type shell");
+#if defined(PETSC_USE_COMPLEX)
+  if (user.jprecision == PBRATU_PRECISION_SINGLE || compare) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"Single precision Jacobian coefficients require real scalars");
+#endif
+#if !defined(PBRATU_HAVE_FASTMATH)
+  if (user.fastmath || fastcompare) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_fastmath requires real double precision scalars");
+#endif
+  if (server[0] && (nbench || compare || fastcompare || ensemble[0] || cont.n > 1 || restart[0] || cont.checkpoint[0] || output.prefix[0])) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_server cannot be combined with benchmark, comparison, ensemble, continuation, checkpoint or output modes");
+  if (compare && fastcompare) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_precision_compare and -pbratu_fastmath_compare are separate runs");
+  if (dim != 2 && dim != 3) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"-pbratu_dim must be 2 or 3");
+  if (bc[0] != PBRATU_BC_DIRICHLET && bc[1] != PBRATU_BC_DIRICHLET) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_INCOMP,"-pbratu_bc needs dirichlet in one direction at least: otherwise there is no solution for lambda > 0, and none unique for lambda = 0");
+  if (bc[0] != PBRATU_BC_DIRICHLET || bc[1] != PBRATU_BC_DIRICHLET) {
+    if (dim == 3) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_bc periodic and neumann are only implemented in 2D");
+    if (overlap) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_overlap is only implemented with -pbratu_bc dirichlet");
+    if (user.picard.on || user.etacache) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_picard and -pbratu_eta_cache are only implemented with -pbratu_bc dirichlet");
+  }
+  if (dim == 3) {
+    if (user.kernel != PBRATU_KERNEL_SCALAR) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_kernel simd is only implemented in 2D");
+    if (user.tile[0] || user.tile[1]) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_tile is only implemented in 2D");
+    if (user.jtype == PBRATU_JACOBIAN_SHELL) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_jacobian_type shell is only implemented in 2D");
+    if (overlap) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_overlap is only implemented in 2D");
+    if (user.picard.on) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_picard is only implemented in 2D");
+    if (user.etacache) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_eta_cache is only implemented in 2D");
+  }
+#if !defined(PBRATU_HAVE_SIMD)
+  if (user.kernel == PBRATU_KERNEL_SIMD) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_kernel simd requires building with make PBRATU_SIMD=avx2|avx512|neon and real double precision");
+#endif
+
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     Create nonlinear solver context
+     Create nonlinear solver context; in ensemble mode, on the group of
+     esize ranks this rank belongs to
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-  ierr = SNESCreate(PETSC_COMM_WORLD,&snes);CHKERRQ(ierr);
+  comm = PETSC_COMM_WORLD;
+  if (ensemble[0]) {
+    ierr = MPI_Comm_rank(PETSC_COMM_WORLD,&rank);CHKERRQ(ierr);
+    ierr = MPI_Comm_size(PETSC_COMM_WORLD,&size);CHKERRQ(ierr);
+    if (esize < 1 || size % esize) SETERRQ2(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"-pbratu_ensemble_size %D does not divide the %d ranks",esize,(int)size);
+    if (nbench || compare || fastcompare || cont.n > 1 || restart[0] || cont.checkpoint[0] || output.prefix[0] || telemetry.file[0]) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_ensemble cannot be combined with benchmark, comparison, continuation, checkpoint, output or telemetry modes");
+    ierr = MPI_Comm_split(PETSC_COMM_WORLD,rank/esize,rank,&comm);CHKERRQ(ierr);
+  }
+  ierr = SNESCreate(comm,&snes);CHKERRQ(ierr);
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     Create distributed array (DMDA) to manage parallel grid and vectors
+     Create distributed array (DMDA) to manage parallel grid and vectors;
+     with -pbratu_partition halo, the process grid and ownership ranges
+     are chosen for the final grid size, before DMSetUp(); in 2D the
+     boundary type of each direction is that of its -pbratu_bc condition
   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-  ierr = DMDACreate2d(PETSC_COMM_WORLD,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DMDA_STENCIL_BOX,
-                      4,4,PETSC_DECIDE,PETSC_DECIDE,1,1,PETSC_NULL,PETSC_NULL,&dm);CHKERRQ(ierr);
+  if (dim == 3) {
+    ierr = DMDACreate3d(comm,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DM_BOUNDARY_NONE,DMDA_STENCIL_BOX,
+                        4,4,4,PETSC_DECIDE,PETSC_DECIDE,PETSC_DECIDE,1,1,PETSC_NULL,PETSC_NULL,PETSC_NULL,&dm);CHKERRQ(ierr);
+  } else {
+    ierr = DMDACreate2d(comm,PBratuBCBoundaryTypes[bc[0]],PBratuBCBoundaryTypes[bc[1]],DMDA_STENCIL_BOX,
+                        4,4,PETSC_DECIDE,PETSC_DECIDE,1,1,PETSC_NULL,PETSC_NULL,&dm);CHKERRQ(ierr);
+  }
   ierr = DMSetFromOptions(dm);CHKERRQ(ierr);
+  if (restart[0]) {
+    /* the grid is that of the checkpoint */
+    ierr = ReadCheckpoint(restart,PETSC_NULL,&hdr);CHKERRQ(ierr);
+    if (hdr.dim != dim) SETERRQ3(PETSC_COMM_WORLD,PETSC_ERR_ARG_INCOMP,"Checkpoint %s is %DD, not %DD",restart,hdr.dim,dim);
+    ierr = DMDASetSizes(dm,hdr.mx,hdr.my,hdr.mz);CHKERRQ(ierr);
+  }
+  if (partition == PBRATU_PARTITION_HALO) {ierr = SetUpPartition(dm);CHKERRQ(ierr);}
   ierr = DMSetUp(dm);CHKERRQ(ierr);
+  if (partreport) {ierr = PartitionReport(dm);CHKERRQ(ierr);}
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Attach the DM to SNES, used for coarsening, refinement, and callbacks
@@ -100,54 +1053,285 @@ int main(int argc,char **argv)
 
   /*  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Extract global vectors from DM; then duplicate for remaining
-     vectors that are the same types
+     vectors that are the same types.  The residual vector is handed to
+     SNES, which keeps the only reference: the application holds just the
+     solution.  After a grid sequencing refinement, SNES creates the
+     residual vector of the finer grid itself.
    - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = DMCreateGlobalVector(dm,&x);CHKERRQ(ierr);
   ierr = VecDuplicate(x,&r);CHKERRQ(ierr);
+#if defined(PBRATU_HAVE_CUDA)
+  ierr = PetscObjectTypeCompareAny((PetscObject)x,&user.cuda,VECSEQCUDA,VECMPICUDA,"");CHKERRQ(ierr);
+  if (user.cuda && dim == 3) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"The CUDA kernels are only implemented in 2D");
+  if (user.cuda && (user.jprecision == PBRATU_PRECISION_SINGLE || compare)) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"The CUDA Jacobian has no single precision coefficients");
+  if (user.cuda && (user.fastmath || fastcompare)) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"The CUDA residual uses the device math library, without -pbratu_fastmath");
+#endif
+  ierr = SNESSetFunction(snes,r,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+  ierr = VecDestroy(&r);CHKERRQ(ierr);
+
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Set local residual evaluation routine; with -pbratu_overlap it is
+     replaced by a global one that does its own ghost point exchange
+  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if (dim == 3) {
+    ierr = DMDASNESSetFunctionLocal(dm,INSERT_VALUES,(DMDASNESFunction)FormFunctionLocal3d,&user);CHKERRQ(ierr);
+  } else {
+    ierr = DMDASNESSetFunctionLocal(dm,INSERT_VALUES,(DMDASNESFunction)FormFunctionLocal,&user);CHKERRQ(ierr);
+  }
+  if (overlap) {
+    ierr = DMSNESSetFunction(dm,FormFunctionOverlap,&user);CHKERRQ(ierr);
+  }
+#if defined(PBRATU_HAVE_CUDA)
+  if (user.cuda) {
+    ierr = DMSNESSetFunction(dm,FormFunctionCUDA,&user);CHKERRQ(ierr);
+  }
+#endif
+
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     Set local Jacobian evaluation routine; the matrix is the DMDA's
+     preallocated AIJ matrix, created by SNES through DMCreateMatrix(),
+     or with -pbratu_jacobian_type shell a MATSHELL, which supports
+     preconditioners that only need MatMult() and MatGetDiagonal()
+     (the default becomes Jacobi).  On the GPU the Jacobian is always
+     the MATSHELL, with its coefficients kept on the device.  With
+     -pbratu_jacobian_type fd, the Jacobian of every grid and multigrid
+     level is the AIJ matrix computed by FormJacobianColoring().  With
+     -pbratu_picard, FormJacobianPicardLocal() assembles the Picard
+     operator into the same AIJ matrix until PicardMonitor() switches to
+     Newton.  With -pbratu_eta_cache, both the residual and the Jacobian
+     are replaced by global routines that share the face coefficients.
+  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if (user.cuda) user.jtype = PBRATU_JACOBIAN_SHELL;
+  if ((bc[0] != PBRATU_BC_DIRICHLET || bc[1] != PBRATU_BC_DIRICHLET) && user.jtype == PBRATU_JACOBIAN_SHELL) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_bc periodic and neumann need -pbratu_jacobian_type aij or fd, on the host");
+  if (user.picard.on && user.jtype != PBRATU_JACOBIAN_AIJ) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_picard requires -pbratu_jacobian_type aij");
+  if (user.etacache && (user.jtype != PBRATU_JACOBIAN_AIJ || overlap)) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_eta_cache requires -pbratu_jacobian_type aij, without -pbratu_overlap");
+  if (user.etacache && (user.kernel != PBRATU_KERNEL_SCALAR || user.tile[0] || user.tile[1])) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_eta_cache has its own residual kernel, without -pbratu_kernel simd or -pbratu_tile");
+  if (user.picard.on) {
+    ierr = DMDASNESSetJacobianLocal(dm,(DMDASNESJacobian)FormJacobianPicardLocal,&user);CHKERRQ(ierr);
+  } else if (user.jtype == PBRATU_JACOBIAN_SHELL) {
+    KSP ksp;
+    PC  pc;
+
+    ierr = DMDASNESSetJacobianLocal(dm,(DMDASNESJacobian)FormJacobianShellLocal,&user);CHKERRQ(ierr);
+    ierr = SNESGetKSP(snes,&ksp);CHKERRQ(ierr);
+    ierr = KSPGetPC(ksp,&pc);CHKERRQ(ierr);
+    ierr = PCSetType(pc,PCJACOBI);CHKERRQ(ierr);
+  } else if (user.jtype == PBRATU_JACOBIAN_FD) {
+    ierr = DMSNESSetJacobian(dm,FormJacobianColoring,&user);CHKERRQ(ierr);
+  } else if (dim == 3) {
+    ierr = DMDASNESSetJacobianLocal(dm,(DMDASNESJacobian)FormJacobianLocal3d,&user);CHKERRQ(ierr);
+  } else {
+    ierr = DMDASNESSetJacobianLocal(dm,(DMDASNESJacobian)FormJacobianLocal,&user);CHKERRQ(ierr);
+  }
+#if defined(PBRATU_HAVE_CUDA)
+  if (user.cuda) {
+    ierr = DMSNESSetJacobian(dm,FormJacobianCUDA,&user);CHKERRQ(ierr);
+  }
+#endif
+  if (user.etacache) {
+    ierr = DMSNESSetFunction(dm,FormFunctionCached,&user);CHKERRQ(ierr);
+    ierr = DMSNESSetJacobian(dm,FormJacobianCached,&user);CHKERRQ(ierr);
+  }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     Set local residual evaluation routine
+     Set the pointwise nonlinear Gauss-Seidel smoother of -snes_type ngs
+     and of the levels of -snes_type fas; like the other callbacks it is
+     inherited by the coarsened and refined DMDAs.  In 3D, and with
+     periodic or Neumann sides, SNESNGS uses its default, coloring-based,
+     smoother.
   - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-  ierr = DMDASNESSetFunctionLocal(dm,INSERT_VALUES,(DMDASNESFunction)FormFunctionLocal,&user);CHKERRQ(ierr);
+  if (dim == 2 && bc[0] == PBRATU_BC_DIRICHLET && bc[1] == PBRATU_BC_DIRICHLET) {
+    ierr = DMSNESSetNGS(dm,NonlinearGS,&user);CHKERRQ(ierr);
+  }
   ierr = DMSetApplicationContext(dm,&user);CHKERRQ(ierr);
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Customize nonlinear solver; set runtime options
    - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   ierr = SNESSetFromOptions(snes);CHKERRQ(ierr);
+  if (output.prefix[0]) {ierr = AsyncOutputCreate(snes,&user,&output);CHKERRQ(ierr);}
+  if (telemetry.file[0]) {ierr = TelemetryCreate(snes,&user,stages[1],&telemetry);CHKERRQ(ierr);}
+  if (user.lag.on) {ierr = SNESSetUpdate(snes,LagUpdate);CHKERRQ(ierr);}
+  if (user.picard.on) {ierr = SNESMonitorSet(snes,PicardMonitor,&user,PETSC_NULL);CHKERRQ(ierr);}
+  ierr = SetUpMultigridRestriction(snes,&user);CHKERRQ(ierr);
+  ierr = SetUpJacobianShell(snes,&user);CHKERRQ(ierr);
+
+  /*
+     Grid sequencing (-snes_grid_sequence K) is driven by SolveGridSequence()
+     rather than inside SNESSolve(), so that each level can be reported
+  */
+  ierr = SNESGetGridSequence(snes,&nseq);CHKERRQ(ierr);
+  ierr = SNESSetGridSequence(snes,0);CHKERRQ(ierr);
+  if (ensemble[0] && nseq) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_ensemble solves on one grid, without grid sequencing");
+  if (server[0] && nseq) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_server solves on the grid of each request, without grid sequencing");
+  if (compare && (nseq || cont.n > 1)) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_precision_compare solves one grid and one (p,lambda)");
+  if (fastcompare && (nseq || cont.n > 1)) SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_SUP,"-pbratu_fastmath_compare solves one grid and one (p,lambda)");
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Evaluate initial guess
      Note: The user should initialize the vector, x, with the initial guess
      for the nonlinear solver prior to calling SNESSolve().  In particular,
      to employ an initial guess of zero, the user should explicitly set
-     this vector to zero by calling VecSet().
+     this vector to zero by calling VecSet().  On restart, the checkpoint
+     is the initial guess, and the continuation resumes after its step if
+     the schedule agrees with its (p,lambda).
   */
-
-  ierr = FormInitialGuess(dm,x);CHKERRQ(ierr);
+  if (restart[0]) {
+    ierr = ReadCheckpoint(restart,x,&hdr);CHKERRQ(ierr);
+    if (cont.n > 1 && hdr.step < cont.n && cont.p[PetscMin(hdr.step,cont.np-1)] == hdr.p && cont.lambda[PetscMin(hdr.step,cont.nlambda-1)] == hdr.lambda) {
+      cont.start = PetscMin(hdr.step+1,cont.n-1);
+    }
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"Restarted from %s: p = %g, lambda = %g, continuation step %D (%D Newton iterations)",
+                       restart,(double)hdr.p,(double)hdr.lambda,hdr.step,hdr.its);CHKERRQ(ierr);
+    if (cont.start) {ierr = PetscPrintf(PETSC_COMM_WORLD,", resuming at step %D",cont.start);CHKERRQ(ierr);}
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"\n");CHKERRQ(ierr);
+  } else {
+    ierr = FormInitialGuess(dm,x);CHKERRQ(ierr);
+  }
+  ierr = PetscLogStagePop();CHKERRQ(ierr);
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     Solve nonlinear system
+     Solve nonlinear system, for every step of the parameter continuation;
+     with grid sequencing, dm and x are replaced by the finest grid and its
+     solution.  In benchmark mode, only evaluate the residual kernel; in
+     comparison modes, solve with both Jacobian precisions, or with and
+     without the approximate exp() and pow(); in ensemble mode, solve the
+     instances of the ensemble file; in server mode, solve the requests as
+     they are read, replacing dm and x when the grid size changes.
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-  ierr = SNESSolve(snes,PETSC_NULL,x);CHKERRQ(ierr);
-  ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
-  ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+  ierr = PetscLogStagePush(stages[1]);CHKERRQ(ierr);
+  if (nbench > 0) {
+    ierr = BenchmarkResidual(dm,x,&user,nbench,streambw);CHKERRQ(ierr);
+  } else if (compare) {
+    ierr = ComparePrecision(snes,x,&user);CHKERRQ(ierr);
+  } else if (fastcompare) {
+    ierr = CompareFastMath(snes,x,&user);CHKERRQ(ierr);
+  } else if (ensemble[0]) {
+    ierr = SolveEnsemble(snes,x,&user,ensemble);CHKERRQ(ierr);
+  } else if (server[0]) {
+    ierr = SolveServer(snes,&dm,&x,&user,server,partition);CHKERRQ(ierr);
+  } else {
+    ierr = SolveContinuation(snes,nseq,&dm,&x,&user,&cont);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
 
-  ierr = PetscPrintf(PETSC_COMM_WORLD,"%s Number of Newton iterations = %D\n",SNESConvergedReasons[reason],its);CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"%s Number of Newton iterations = %D\n",SNESConvergedReasons[reason],its);CHKERRQ(ierr);
+    ierr = SNESGetLinearSolveIterations(snes,&its);CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"Number of linear iterations = %D\n",its);CHKERRQ(ierr);
+    if (user.jtype == PBRATU_JACOBIAN_FD) {
+      ierr = SNESGetNumberFunctionEvals(snes,&its);CHKERRQ(ierr);
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Number of function evaluations = %D (%D colors per Jacobian)\n",its,user.ncolors);CHKERRQ(ierr);
+    }
+    if (user.lag.on) {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Jacobian rebuilt %D times, preconditioner %D times, in %D Newton steps\n",user.lag.njac,user.lag.npc,user.lag.nsteps);CHKERRQ(ierr);
+    }
+    if (user.picard.on) {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Picard steps %D, Newton steps %D\n",user.picard.npicard,user.picard.nnewton);CHKERRQ(ierr);
+    }
+  }
+  ierr = PetscLogStagePop();CHKERRQ(ierr);
+  if (memreport) {ierr = MemoryReport(PETSC_COMM_WORLD);CHKERRQ(ierr);}
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      Free work space.  All PETSc objects should be destroyed when they
      are no longer needed.
    - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-
+  ierr = PetscLogStagePush(stages[2]);CHKERRQ(ierr);
+  if (output.prefix[0]) {ierr = AsyncOutputDestroy(&output);CHKERRQ(ierr);}
+  if (telemetry.file[0]) {ierr = TelemetryDestroy(&telemetry);CHKERRQ(ierr);}
   ierr = VecDestroy(&x);CHKERRQ(ierr);
-  ierr = VecDestroy(&r);CHKERRQ(ierr);
   ierr = SNESDestroy(&snes);CHKERRQ(ierr);
   ierr = DMDestroy(&dm);CHKERRQ(ierr);
+  if (comm != PETSC_COMM_WORLD) {ierr = MPI_Comm_free(&comm);CHKERRQ(ierr);}
+  ierr = PetscLogStagePop();CHKERRQ(ierr);
   ierr = PetscFinalize();CHKERRQ(ierr);
   return 0;
 }
 
+/* ------------------------------------------------------------------- */
+/*
+   RowPartition - Static partition of the owned rows ys <= j < ys+ym into nt contiguous blocks;
+   block t is j0 <= j < j1.
+
+   All threaded loops over the DMDA arrays use this partition, so each thread
+   touches the same pages of x and f in every routine.
+*/
+PETSC_STATIC_INLINE void RowPartition(PetscInt ys,PetscInt ym,PetscInt nt,PetscInt t,PetscInt *j0,PetscInt *j1)
+{
+  *j0 = ys + (ym*t)/nt;
+  *j1 = ys + (ym*(t+1))/nt;
+}
+
+/*
+   InitialGuessRows - Initial guess on the owned points xs <= i < xe of the rows j0 <= j < j1
+*/
+static void InitialGuessRows(PetscInt Mx,PetscInt My,PetscInt xs,PetscInt xe,PetscInt j0,PetscInt j1,PetscScalar **x)
+{
+  PetscInt i,j,is,ie,js,je;
+
+  /*
+     Boundary conditions are all zero Dirichlet
+  */
+  if (j0 == 0) {
+    for (i=xs; i<xe; i++) x[0][i] = 0.0;
+  }
+  if (j1 == My) {
+    for (i=xs; i<xe; i++) x[My-1][i] = 0.0;
+  }
+  if (xs == 0) {
+    for (j=j0; j<j1; j++) x[j][0] = 0.0;
+  }
+  if (xe == Mx) {
+    for (j=j0; j<j1; j++) x[j][Mx-1] = 0.0;
+  }
+
+  /*
+     Interior
+  */
+  is = PetscMax(xs,1); ie = PetscMin(xe,Mx-1);
+  js = PetscMax(j0,1); je = PetscMin(j1,My-1);
+  for (j=js; j<je; j++) {
+    const PetscReal yy = 2*(PetscReal)j/(My-1) - 1,sy = 1 - yy*yy;
+    PetscScalar     *PETSC_RESTRICT xr = x[j];
+
+    PBRATU_PRAGMA_OMP_SIMD
+    for (i=is; i<ie; i++) {
+      const PetscReal xx = 2*(PetscReal)i/(Mx-1) - 1;
+      xr[i] = (1 - xx*xx) * sy;
+    }
+  }
+}
+
+/*
+   InitialGuessPlanes - 3D initial guess on the owned points xs <= i < xe, ys <= j < ye of the planes k0 <= k < k1
+*/
+static void InitialGuessPlanes(PetscInt Mx,PetscInt My,PetscInt Mz,PetscInt xs,PetscInt xe,PetscInt ys,PetscInt ye,PetscInt k0,PetscInt k1,PetscScalar ***x)
+{
+  PetscInt i,j,k;
+
+  for (k=k0; k<k1; k++) {
+    const PetscReal zz = 2*(PetscReal)k/(Mz-1) - 1,sz = 1 - zz*zz;
+
+    for (j=ys; j<ye; j++) {
+      const PetscReal yy = 2*(PetscReal)j/(My-1) - 1,syz = (1 - yy*yy)*sz;
+      PetscScalar     *PETSC_RESTRICT xr = x[k][j];
+
+      /* zero on the boundary: on the planes and rows of the boundary syz vanishes */
+      if (k == 0 || k == Mz-1 || j == 0 || j == My-1) {
+        for (i=xs; i<xe; i++) xr[i] = 0.0;
+        continue;
+      }
+      PBRATU_PRAGMA_OMP_SIMD
+      for (i=PetscMax(xs,1); i<PetscMin(xe,Mx-1); i++) {
+        const PetscReal xx = 2*(PetscReal)i/(Mx-1) - 1;
+        xr[i] = (1 - xx*xx) * syz;
+      }
+      if (xs == 0) xr[0] = 0.0;
+      if (xe == Mx) xr[Mx-1] = 0.0;
+    }
+  }
+}
+
 /* ------------------------------------------------------------------- */
 #undef __FUNCT__
 #define __FUNCT__ "FormInitialGuess"
@@ -163,13 +1347,34 @@ int main(int argc,char **argv)
  */
 static PetscErrorCode FormInitialGuess(DM dm,Vec X)
 {
-  PetscInt       i,j,Mx,My,xs,ys,xm,ym;
+  PetscInt       dim,Mx,My,Mz,xs,ys,zs,xm,ym,zm;
   PetscErrorCode ierr;
-  PetscScalar    **x;
+  PetscScalar    **x,***x3;
 
   PetscFunctionBegin;
-  ierr = DMDAGetInfo(dm,PETSC_IGNORE,&Mx,&My,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
-                     PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);
+  ierr = PetscLogEventBegin(InitialGuessEvent,dm,X,0,0);CHKERRQ(ierr);
+  ierr = DMDAGetInfo(dm,&dim,&Mx,&My,&Mz,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
+                     PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);CHKERRQ(ierr);
+  if (dim == 3) {
+    ierr = DMDAVecGetArray(dm,X,&x3);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(dm,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel
+    {
+      PetscInt k0,k1;
+
+      RowPartition(zs,zm,omp_get_num_threads(),omp_get_thread_num(),&k0,&k1);
+      InitialGuessPlanes(Mx,My,Mz,xs,xs+xm,ys,ys+ym,k0,k1,x3);
+    }
+#else
+    InitialGuessPlanes(Mx,My,Mz,xs,xs+xm,ys,ys+ym,zs,zs+zm,x3);
+#endif
+    ierr = DMDAVecRestoreArray(dm,X,&x3);CHKERRQ(ierr);
+    ierr = PetscLogFlops(11.0*PetscMax(PetscMin(xs+xm,Mx-1)-PetscMax(xs,1),0)*PetscMax(PetscMin(ys+ym,My-1)-PetscMax(ys,1),0)
+                         *PetscMax(PetscMin(zs+zm,Mz-1)-PetscMax(zs,1),0));CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(InitialGuessEvent,dm,X,0,0);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
 
   /*
      Get a pointer to vector data.
@@ -189,60 +1394,3162 @@ static PetscErrorCode FormInitialGuess(DM dm,Vec X)
   ierr = DMDAGetCorners(dm,&xs,&ys,PETSC_NULL,&xm,&ym,PETSC_NULL);CHKERRQ(ierr);
 
   /*
-     Compute initial guess over the locally owned part of the grid
+     Compute initial guess over the locally owned part of the grid, using the
+     same static row partition among threads as FormFunctionLocal()
   */
-  for (j=ys; j<ys+ym; j++) {
-    for (i=xs; i<xs+xm; i++) {
-      if (i == 0 || j == 0 || i == Mx-1 || j == My-1) {
-        /* boundary conditions are all zero Dirichlet */
-        x[j][i] = 0.0;
-      } else {
-          const PetscReal
-            xx = 2*(PetscReal)i/(Mx-1) - 1,
-            yy = 2*(PetscReal)j/(My-1) - 1;
-          x[j][i] = (1 - xx*xx) * (1-yy*yy);
-      }
-    }
+#if defined(_OPENMP)
+#pragma omp parallel
+  {
+    PetscInt j0,j1;
+
+    RowPartition(ys,ym,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+    InitialGuessRows(Mx,My,xs,xs+xm,j0,j1,x);
   }
+#else
+  InitialGuessRows(Mx,My,xs,xs+xm,ys,ys+ym,x);
+#endif
 
   /*
      Restore vector
   */
   ierr = DMDAVecRestoreArray(dm,X,&x);CHKERRQ(ierr);
+  ierr = PetscLogFlops(7.0*PetscMax(PetscMin(xs+xm,Mx-1)-PetscMax(xs,1),0)*PetscMax(PetscMin(ys+ym,My-1)-PetscMax(ys,1),0));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(InitialGuessEvent,dm,X,0,0);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
 
+/* ------------------------------------------------------------------- */
+/*
+   BoundaryRows - Homogeneous Dirichlet condition f = x on the owned points of the rows j0 <= j < j1
+   that lie on Dirichlet sides
+*/
+static void BoundaryRows(const DMDALocalInfo *info,PetscScalar **x,PetscScalar **f,PetscInt j0,PetscInt j1)
+{
+  const PetscInt xs = info->xs,xe = info->xs+info->xm;
+  PetscInt       i,j;
+
+  if (info->by == DM_BOUNDARY_NONE) {
+    if (j0 == 0) {
+      for (i=xs; i<xe; i++) f[0][i] = x[0][i];
+    }
+    if (j1 == info->my) {
+      for (i=xs; i<xe; i++) f[info->my-1][i] = x[info->my-1][i];
+    }
+  }
+  if (info->bx == DM_BOUNDARY_NONE) {
+    if (xs == 0) {
+      for (j=j0; j<j1; j++) f[j][0] = x[j][0];
+    }
+    if (xe == info->mx) {
+      for (j=j0; j<j1; j++) f[j][info->mx-1] = x[j][info->mx-1];
+    }
+  }
+}
+
+/*
+   MirrorGhosts - Sets the ghost points across the Neumann sides of the ghosted local array x to
+   the mirror images x[j][-1] = x[j][1], x[j][mx] = x[j][mx-2] (and likewise in y)
+
+   With these the normal derivative vanishes on the side, and so does the flux through
+   it: the fluxes through the faces just inside and just outside the side cancel.  The x
+   sides are set on every ghosted row first, so that the corners are those of the mirror
+   image in both directions when the y sides are Neumann too.
+*/
+static void MirrorGhosts(const DMDALocalInfo *info,PetscScalar **x)
+{
+  const PetscInt gxs = info->gxs,gxe = info->gxs+info->gxm,gys = info->gys,gye = info->gys+info->gym;
+  PetscInt       i,j;
+
+  if (info->bx == DM_BOUNDARY_GHOSTED) {
+    if (gxs < 0) {
+      for (j=gys; j<gye; j++) x[j][-1] = x[j][1];
+    }
+    if (gxe > info->mx) {
+      for (j=gys; j<gye; j++) x[j][info->mx] = x[j][info->mx-2];
+    }
+  }
+  if (info->by == DM_BOUNDARY_GHOSTED) {
+    if (gys < 0) {
+      for (i=gxs; i<gxe; i++) x[-1][i] = x[1][i];
+    }
+    if (gye > info->my) {
+      for (i=gxs; i<gxe; i++) x[info->my][i] = x[info->my-2][i];
+    }
+  }
+}
+
+/*
+   NeumannRows - Halves the residual of the points on the Neumann sides among is <= i < ie, js <= j < je
+
+   Over the mirror images the stencil balances the fluxes of a whole cell, twice the half
+   cell (at corners, four times the quarter cell) the domain leaves to a point on a side.
+*/
+static void NeumannRows(const DMDALocalInfo *info,PetscScalar **f,PetscInt is,PetscInt ie,PetscInt js,PetscInt je)
+{
+  PetscInt i,j;
+
+  if (info->bx == DM_BOUNDARY_GHOSTED) {
+    if (is == 0) {
+      for (j=js; j<je; j++) f[j][0] *= 0.5;
+    }
+    if (ie == info->mx) {
+      for (j=js; j<je; j++) f[j][info->mx-1] *= 0.5;
+    }
+  }
+  if (info->by == DM_BOUNDARY_GHOSTED) {
+    if (js == 0) {
+      for (i=is; i<ie; i++) f[0][i] *= 0.5;
+    }
+    if (je == info->my) {
+      for (i=is; i<ie; i++) f[info->my-1][i] *= 0.5;
+    }
+  }
+}
+
+/*
+   InteriorPoints - Number of the owned points of the 2D grid on no Dirichlet side
+*/
+PETSC_STATIC_INLINE PetscLogDouble InteriorPoints(const DMDALocalInfo *info)
+{
+  PetscInt is,ie,js,je;
+
+  InteriorRange(info->xs,info->xs+info->xm,info->mx,info->bx,&is,&ie);
+  InteriorRange(info->ys,info->ys+info->ym,info->my,info->by,&js,&je);
+  return (PetscLogDouble)PetscMax(ie-is,0)*PetscMax(je-js,0);
+}
+
+/*
+   ResidualTiles - Evaluates the residual at the interior points is <= i < ie, js <= j < je.
+
+   With -pbratu_tile tx,ty the points are traversed in tiles of tx by ty
+   points, so that the three rows of a tile read by the stencil stay in cache
+   for large local subdomains.  Each tile recomputes the fluxes through its
+   lower faces, i.e. one row of faces per ty rows.  work must hold
+   PBRATU_BLOCK_WORK(tx) entries.
+*/
+static void ResidualTiles(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,PetscScalar **f,
+                          PetscInt is,PetscInt ie,PetscInt js,PetscInt je,PetscScalar *work)
+{
+  PetscInt it,jt,tx,ty;
+
+  if (is < ie && js < je) {
+    tx = user->tile[0] ? PetscMin(user->tile[0],ie-is) : ie-is;
+    ty = user->tile[1] ? PetscMin(user->tile[1],je-js) : je-js;
+    for (jt=js; jt<je; jt+=ty) {
+      for (it=is; it<ie; it+=tx) {
+        ResidualBlock(info,user,x,f,it,PetscMin(it+tx,ie),jt,PetscMin(jt+ty,je),work);
+      }
+    }
+  }
+}
+
+/*
+   FormFunctionRows - Evaluates F(x) on the owned points of the rows j0 <= j < j1.
+
+   The homogeneous Dirichlet rows and columns are filled, and the Neumann sides
+   scaled, by separate short loops, so the interior, evaluated by ResidualBlock(),
+   needs no per-point boundary test.  The ghost points across Neumann sides must
+   have been set by MirrorGhosts().
+ */
+static void FormFunctionRows(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,PetscScalar **f,PetscInt j0,PetscInt j1,PetscScalar *work)
+{
+  PetscInt is,ie,js,je;
+
+  InteriorRange(info->xs,info->xs+info->xm,info->mx,info->bx,&is,&ie);
+  InteriorRange(j0,j1,info->my,info->by,&js,&je);
+  BoundaryRows(info,x,f,j0,j1);
+  ResidualTiles(info,user,x,f,is,ie,js,je,work);
+  NeumannRows(info,f,is,ie,js,je);
+}
+
+/*
+   ResidualFlops - Floating point operations of FormFunctionLocal() or FormFunctionLocal3d() on the owned points
+   (pow and exp counted as one each)
+ */
+static PetscLogDouble ResidualFlops(const DMDALocalInfo *info,const AppCtx *user)
+{
+  const PetscLogDouble nin = InteriorPoints(info);
+
+  if (info->dim == 3) {
+    return nin*PetscMax(PetscMin(info->zs+info->zm,info->mz-1) - PetscMax(info->zs,1),0)
+           *((user->p == 2 ? 15.0 : 66.0) + (user->lambda ? 3.0 : 0));
+  }
+  return nin*((user->p == 2 ? 10.0 : 33.0) + (user->lambda ? 3.0 : 0));
+}
+
 /* ------------------------------------------------------------------- */
 #undef __FUNCT__
 #define __FUNCT__ "FormFunctionLocal"
 /*
    FormFunctionLocal - Evaluates nonlinear function, F(x).
+
+   With OpenMP the owned rows are divided among the threads with RowPartition(),
+   each thread using its own slice of the work array.  The ghost points across
+   Neumann sides are set beforehand.
  */
 static PetscErrorCode FormFunctionLocal(DMDALocalInfo *info,PetscScalar **x,PetscScalar **f,AppCtx *user)
 {
-  PetscReal      hx,hy,hxdhy,hydhx;
+  PetscInt       is,ie,nin,nwork,nt = 1;
+  PetscScalar    *work;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr  = PetscLogEventBegin(ResidualEvent,info->da,0,0,0);CHKERRQ(ierr);
+  MirrorGhosts(info,x);
+  InteriorRange(info->xs,info->xs+info->xm,info->mx,info->bx,&is,&ie);
+  nin   = PetscMax(ie-is,0);
+  nwork = PBRATU_BLOCK_WORK(user->tile[0] ? PetscMin(user->tile[0],nin) : nin);
+#if defined(_OPENMP)
+  nt    = omp_get_max_threads();
+#endif
+  ierr = DMGetWorkArray(info->da,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(nt)
+  {
+    PetscInt j0,j1;
+
+    RowPartition(info->ys,info->ym,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+    FormFunctionRows(info,user,x,f,j0,j1,work+omp_get_thread_num()*nwork);
+  }
+#else
+  FormFunctionRows(info,user,x,f,info->ys,info->ys+info->ym,work);
+#endif
+  ierr = DMRestoreWorkArray(info->da,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+  ierr = PetscLogFlops(ResidualFlops(info,user));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(ResidualEvent,info->da,0,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "FormFunctionOverlap"
+/*
+   FormFunctionOverlap - Evaluates F(x) while the ghost points are being exchanged
+
+   Used instead of FormFunctionLocal() with -pbratu_overlap.  Between
+   DMGlobalToLocalBegin() and DMGlobalToLocalEnd() the points whose stencil
+   lies in the owned part of the grid are evaluated from the array of the
+   global vector, and the Dirichlet rows are filled; after the exchange, the
+   strip of points along the subdomain edges is evaluated from the local
+   vector.  With OpenMP the rows of the inner points are divided among the
+   threads as in FormFunctionLocal().
+ */
+static PetscErrorCode FormFunctionOverlap(SNES snes,Vec X,Vec F,void *ctx)
+{
+  AppCtx         *user = (AppCtx*)ctx;
+  DM             dm;
+  DMDALocalInfo  info;
+  Vec            Xloc;
+  PetscScalar    **x,**xg,**f,*work;
+  PetscInt       is,ie,js,je,ii0,ii1,jj0,jj1,nwork,nt = 1;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+
+  /*
+     Interior points is <= i < ie, js <= j < je, and those among them that need
+     no ghost points, ii0 <= i < ii1, jj0 <= j < jj1 (none when jj0 == jj1)
+  */
+  is  = PetscMax(info.xs,1); ie = PetscMin(info.xs+info.xm,info.mx-1);
+  js  = PetscMax(info.ys,1); je = PetscMin(info.ys+info.ym,info.my-1);
+  ii0 = PetscMax(info.xs+1,is); ii1 = PetscMin(info.xs+info.xm-1,ie);
+  jj0 = PetscMax(info.ys+1,js); jj1 = PetscMin(info.ys+info.ym-1,je);
+  if (ii0 >= ii1 || jj0 >= jj1) {ii0 = ii1 = is; jj0 = jj1 = js;}
+  nwork = PBRATU_BLOCK_WORK(user->tile[0] ? PetscMin(user->tile[0],PetscMax(ie-is,0)) : PetscMax(ie-is,0));
+#if defined(_OPENMP)
+  nt    = omp_get_max_threads();
+#endif
+  ierr = DMGetWorkArray(dm,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+
+  ierr = DMDAVecGetArrayRead(dm,X,&xg);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(dm,F,&f);CHKERRQ(ierr);
+  BoundaryRows(&info,xg,f,info.ys,info.ys+info.ym);
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(nt)
+  {
+    PetscInt j0,j1;
+
+    RowPartition(jj0,jj1-jj0,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+    ResidualTiles(&info,user,xg,f,ii0,ii1,j0,j1,work+omp_get_thread_num()*nwork);
+  }
+#else
+  ResidualTiles(&info,user,xg,f,ii0,ii1,jj0,jj1,work);
+#endif
+  ierr = DMDAVecRestoreArrayRead(dm,X,&xg);CHKERRQ(ierr);
+
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  ResidualTiles(&info,user,x,f,is,ie,js,jj0,work);
+  ResidualTiles(&info,user,x,f,is,ie,jj1,je,work);
+  ResidualTiles(&info,user,x,f,is,ii0,jj0,jj1,work);
+  ResidualTiles(&info,user,x,f,ii1,ie,jj0,jj1,work);
+  ierr = DMDAVecRestoreArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArray(dm,F,&f);CHKERRQ(ierr);
+
+  ierr = DMRestoreWorkArray(dm,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = PetscLogFlops(ResidualFlops(&info,user));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+/*
+   Face coefficient cache (-pbratu_eta_cache)
+
+   Every residual and Jacobian evaluation needs eta at each face, a pow()
+   that costs more than the rest of the stencil.  FormFunctionCached() and
+   FormJacobianCached() take eta and deta from an EtaCache, recomputed only
+   when the state changes; e.g. the Jacobian of a Newton step reuses the
+   coefficients of the residual from which the step started.  The hits and
+   misses are logged as the events PBratuEtaReuse and PBratuEtaCompute.
+*/
+#undef __FUNCT__
+#define __FUNCT__ "EtaCacheDestroy"
+static PetscErrorCode EtaCacheDestroy(void *ctx)
+{
+  EtaCache       *cache = (EtaCache*)ctx;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscFree5(cache->ex,cache->dex,cache->ey,cache->dey,cache->x);CHKERRQ(ierr);
+  ierr = PetscFree(cache);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+   EtaCacheRows - Computes the coefficients of the y-faces (i,j+1/2) and the x-faces (i+1/2,j+1)
+   for j0 <= j < j1, js-1 <= j < je
+*/
+static void EtaCacheRows(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **x,EtaCache *cache,PetscInt j0,PetscInt j1)
+{
+  const PetscReal dhx = (PetscReal)(info->mx-1),dhy = (PetscReal)(info->my-1);
+  const PetscReal e2 = PetscSqr(user->epsilon),q = 0.5*(user->p-2.);
+  const PetscInt  n  = cache->ie-cache->is;
+  PetscInt        i,j;
+
+  /* gamma goes to deta, eta = gamma^q is applied by PowRow(), then deta = q eta/gamma */
+  for (j=j0; j<j1; j++) {
+    PetscScalar *PETSC_RESTRICT ey = cache->ey+PBRATU_YFACE(cache,cache->is,j),*PETSC_RESTRICT dey = cache->dey+PBRATU_YFACE(cache,cache->is,j);
+
+    PBRATU_PRAGMA_OMP_SIMD
+    for (i=cache->is; i<cache->ie; i++) {
+      const PetscScalar
+        ux = 0.25*dhx*(x[j][i+1]+x[j+1][i+1]-x[j][i-1]-x[j+1][i-1]),
+        uy = dhy*(x[j+1][i]-x[j][i]);
+      ey[i-cache->is]  = 1;
+      dey[i-cache->is] = e2+0.5*(ux*ux + uy*uy);
+    }
+    PowRow(user,n,q,dey,ey);
+    PBRATU_PRAGMA_OMP_SIMD
+    for (i=0; i<n; i++) dey[i] = q*ey[i]/dey[i];
+    if (j+1 < cache->je) {
+      PetscScalar *PETSC_RESTRICT ex = cache->ex+PBRATU_XFACE(cache,cache->is-1,j+1),*PETSC_RESTRICT dex = cache->dex+PBRATU_XFACE(cache,cache->is-1,j+1);
+
+      PBRATU_PRAGMA_OMP_SIMD
+      for (i=cache->is-1; i<cache->ie; i++) {
+        const PetscScalar
+          ux = dhx*(x[j+1][i+1]-x[j+1][i]),
+          uy = 0.25*dhy*(x[j+2][i]+x[j+2][i+1]-x[j][i]-x[j][i+1]);
+        ex[i-cache->is+1]  = 1;
+        dex[i-cache->is+1] = e2+0.5*(ux*ux + uy*uy);
+      }
+      PowRow(user,n+1,q,dex,ex);
+      PBRATU_PRAGMA_OMP_SIMD
+      for (i=0; i<n+1; i++) dex[i] = q*ex[i]/dex[i];
+    }
+  }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "EtaCacheGet"
+/*
+   EtaCacheGet - Returns the cache of dm, with the coefficients of the state X, whose ghosted
+   local form is Xloc
+
+   The cache is composed with dm as "PBratuEtaCache", so each grid and each
+   multigrid level has its own.  It is valid for X if X is the vector it was
+   computed from, unchanged since (same id and PetscObjectState), or if Xloc
+   holds the same values, which catches the line searches that copy their
+   accepted trial point into the solution vector; p and epsilon must also
+   match, as continuation changes them for the same vector.  The comparison
+   is a local memory pass, and each rank decides on its own.
+ */
+static PetscErrorCode EtaCacheGet(DM dm,const DMDALocalInfo *info,Vec X,Vec Xloc,const AppCtx *user,EtaCache **cache)
+{
+  PetscContainer   container;
+  EtaCache         *c;
+  PetscObjectId    id;
+  PetscObjectState state;
+  PetscScalar      **x;
+  const PetscScalar *xa;
+  PetscInt         nx;
+  PetscBool        hit;
+  PetscErrorCode   ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectQuery((PetscObject)dm,"PBratuEtaCache",(PetscObject*)&container);CHKERRQ(ierr);
+  if (container) {
+    ierr = PetscContainerGetPointer(container,(void**)&c);CHKERRQ(ierr);
+  } else {
+    ierr = PetscNew(&c);CHKERRQ(ierr);
+    c->is = PetscMax(info->xs,1); c->ie = PetscMax(PetscMin(info->xs+info->xm,info->mx-1),c->is);
+    c->js = PetscMax(info->ys,1); c->je = PetscMax(PetscMin(info->ys+info->ym,info->my-1),c->js);
+    c->nx = info->gxm*info->gym;
+    ierr = PetscMalloc5((c->ie-c->is+1)*(c->je-c->js),&c->ex,(c->ie-c->is+1)*(c->je-c->js),&c->dex,
+                        (c->ie-c->is)*(c->je-c->js+1),&c->ey,(c->ie-c->is)*(c->je-c->js+1),&c->dey,c->nx,&c->x);CHKERRQ(ierr);
+    ierr = PetscContainerCreate(PETSC_COMM_SELF,&container);CHKERRQ(ierr);
+    ierr = PetscContainerSetPointer(container,c);CHKERRQ(ierr);
+    ierr = PetscContainerSetUserDestroy(container,EtaCacheDestroy);CHKERRQ(ierr);
+    ierr = PetscObjectCompose((PetscObject)dm,"PBratuEtaCache",(PetscObject)container);CHKERRQ(ierr);
+    ierr = PetscContainerDestroy(&container);CHKERRQ(ierr);
+  }
+  ierr = PetscObjectGetId((PetscObject)X,&id);CHKERRQ(ierr);
+  ierr = PetscObjectStateGet((PetscObject)X,&state);CHKERRQ(ierr);
+  ierr = VecGetLocalSize(Xloc,&nx);CHKERRQ(ierr);
+  if (nx != c->nx) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_PLIB,"Local vector of size %D, the cache has %D",nx,c->nx);
+  ierr = VecGetArrayRead(Xloc,&xa);CHKERRQ(ierr);
+  hit  = (PetscBool)(c->valid && c->p == user->p && c->epsilon == user->epsilon && c->fastmath == user->fastmath);
+  if (hit && (c->id != id || c->state != state)) {
+    ierr = PetscMemcmp(c->x,xa,nx*sizeof(PetscScalar),&hit);CHKERRQ(ierr);
+  }
+  if (hit) {
+    ierr = PetscLogEventBegin(EtaReuseEvent,dm,X,0,0);CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(EtaReuseEvent,dm,X,0,0);CHKERRQ(ierr);
+  } else {
+    ierr = PetscLogEventBegin(EtaComputeEvent,dm,X,0,0);CHKERRQ(ierr);
+    ierr = PetscMemcpy(c->x,xa,nx*sizeof(PetscScalar));CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel
+    {
+      PetscInt j0,j1;
+
+      RowPartition(c->js-1,c->je-c->js+1,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+      EtaCacheRows(info,user,x,c,j0,j1);
+    }
+#else
+    EtaCacheRows(info,user,x,c,c->js-1,c->je);
+#endif
+    ierr = DMDAVecRestoreArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+    c->p       = user->p;
+    c->epsilon  = user->epsilon;
+    c->fastmath = user->fastmath;
+    c->valid    = PETSC_TRUE;
+    ierr = PetscLogFlops(16.0*((c->ie-c->is+1)*(c->je-c->js) + (c->ie-c->is)*(c->je-c->js+1)));CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(EtaComputeEvent,dm,X,0,0);CHKERRQ(ierr);
+  }
+  c->id    = id;
+  c->state = state;
+  ierr = VecRestoreArrayRead(Xloc,&xa);CHKERRQ(ierr);
+  *cache = c;
+  PetscFunctionReturn(0);
+}
+
+/*
+   ResidualCachedRows - Evaluates F(x) on the owned points of the rows j0 <= j < j1 from the cached face diffusivities
+*/
+static void ResidualCachedRows(const DMDALocalInfo *info,const AppCtx *user,const EtaCache *cache,PetscScalar **x,PetscScalar **f,PetscInt j0,PetscInt j1)
+{
+  const PetscReal hx = GridSpacing(info->mx,info->bx),hy = GridSpacing(info->my,info->by);
+  const PetscReal sc = hx*hy*user->lambda,dhx = 1/hx,dhy = 1/hy;
+  const PetscInt  is = cache->is,n = cache->ie-cache->is;
+  PetscInt        j,k;
+
+  BoundaryRows(info,x,f,j0,j1);
+  for (j=PetscMax(j0,cache->js); j<PetscMin(j1,cache->je); j++) {
+    const PetscScalar *PETSC_RESTRICT xs = x[j-1]+is,*PETSC_RESTRICT xc = x[j]+is,*PETSC_RESTRICT xn = x[j+1]+is;
+    const PetscScalar *PETSC_RESTRICT ex = cache->ex+PBRATU_XFACE(cache,is,j);
+    const PetscScalar *PETSC_RESTRICT eyN = cache->ey+PBRATU_YFACE(cache,is,j),*PETSC_RESTRICT eyS = cache->ey+PBRATU_YFACE(cache,is,j-1);
+    PetscScalar       *PETSC_RESTRICT fr = f[j]+is;
+
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) {
+      fr[k] = -hy*dhx*(ex[k]*(xc[k+1]-xc[k]) - ex[k-1]*(xc[k]-xc[k-1]))
+              - hx*dhy*(eyN[k]*(xn[k]-xc[k]) - eyS[k]*(xc[k]-xs[k]));
+    }
+    if (sc) BratuRow(user,n,sc,xc,fr);
+  }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormFunctionCached"
+/*
+   FormFunctionCached - Evaluates F(x) with the face coefficients of EtaCacheGet() (-pbratu_eta_cache)
+ */
+static PetscErrorCode FormFunctionCached(SNES snes,Vec X,Vec F,void *ctx)
+{
+  AppCtx         *user = (AppCtx*)ctx;
+  DM             dm;
+  DMDALocalInfo  info;
+  Vec            Xloc;
+  EtaCache       *cache;
+  PetscScalar    **x,**f;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = EtaCacheGet(dm,&info,X,Xloc,user,&cache);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(dm,F,&f);CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel
+  {
+    PetscInt j0,j1;
+
+    RowPartition(info.ys,info.ym,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+    ResidualCachedRows(&info,user,cache,x,f,j0,j1);
+  }
+#else
+  ResidualCachedRows(&info,user,cache,x,f,info.ys,info.ys+info.ym);
+#endif
+  ierr = DMDAVecRestoreArray(dm,F,&f);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = PetscLogFlops((14.0 + (user->lambda ? 3.0 : 0))*(cache->ie-cache->is)*(cache->je-cache->js));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianCached"
+/*
+   FormJacobianCached - Assembles the Newton (or, with -pbratu_picard, the Picard) Jacobian with the face
+   coefficients of EtaCacheGet() (-pbratu_eta_cache)
+ */
+static PetscErrorCode FormJacobianCached(SNES snes,Vec X,Mat J,Mat B,void *ctx)
+{
+  AppCtx         *user = (AppCtx*)ctx;
+  DM             dm;
+  DMDALocalInfo  info;
+  Vec            Xloc;
+  EtaCache       *cache;
+  PetscScalar    **x;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = EtaCacheGet(dm,&info,X,Xloc,user,&cache);CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  if (user->picard.on) {
+    ierr = AssemblePicard(&info,x,J,B,user,cache);CHKERRQ(ierr);
+  } else {
+    ierr = AssembleJacobian(&info,x,J,B,user,cache);CHKERRQ(ierr);
+  }
+  ierr = DMDAVecRestoreArrayRead(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianLocal"
+/*
+   FormJacobianLocal - Evaluates the Jacobian matrix of the p-Bratu operator.
+
+   The diffusive flux through each cell face is eta(gamma) times the normal
+   derivative, where the tangential derivative entering gamma is averaged over
+   the four adjacent points.  Differentiating that flux couples every point to
+   all eight neighbors, which gives the 9-point (box) stencil assembled here.
+ */
+static PetscErrorCode FormJacobianLocal(DMDALocalInfo *info,PetscScalar **x,Mat J,Mat B,AppCtx *user)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AssembleJacobian(info,x,J,B,user,PETSC_NULL);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "AssembleJacobian"
+/*
+   AssembleJacobian - FormJacobianLocal(), with the face diffusivities and their derivatives taken from
+   the cache when it is not NULL
+ */
+static PetscErrorCode AssembleJacobian(DMDALocalInfo *info,PetscScalar **x,Mat J,Mat B,AppCtx *user,const EtaCache *cache)
+{
+  PetscReal      hx,hy,dhx,dhy,sc;
+  PetscInt       i,j;
+  PetscScalar    v[3][3];
+  MatStencil     row,col[9];
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscLogEventBegin(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  hx  = GridSpacing(info->mx,info->bx);
+  hy  = GridSpacing(info->my,info->by);
+  sc  = hx*hy*user->lambda;
+  dhx = 1/hx;
+  dhy = 1/hy;
+  MirrorGhosts(info,x);
+  /*
+     Compute entries for the locally owned part of the Jacobian.
+      - Each processor needs to insert only elements that it owns
+        locally (but any non-local elements will be sent to the
+        appropriate processor during matrix assembly).
+      - Here, we set all entries for a particular row at once.
+      - We can set matrix entries either using either
+        MatSetValuesLocal() or MatSetValues(), as discussed above.
+  */
+  for (j=info->ys; j<info->ys+info->ym; j++) {
+    for (i=info->xs; i<info->xs+info->xm; i++) {
+      row.j = j; row.i = i;
+      if ((info->bx == DM_BOUNDARY_NONE && (i == 0 || i == info->mx-1)) || (info->by == DM_BOUNDARY_NONE && (j == 0 || j == info->my-1))) {
+        const PetscScalar one = 1.0;
+        /* homogeneous Dirichlet boundary condition */
+        ierr = MatSetValuesStencil(B,1,&row,1,&row,&one,INSERT_VALUES);CHKERRQ(ierr);
+      } else {
+        const PetscScalar
+          ux_E = dhx*(x[j][i+1]-x[j][i]),
+          uy_E = 0.25*dhy*(x[j+1][i]+x[j+1][i+1]-x[j-1][i]-x[j-1][i+1]),
+          ux_W = dhx*(x[j][i]-x[j][i-1]),
+          uy_W = 0.25*dhy*(x[j+1][i-1]+x[j+1][i]-x[j-1][i-1]-x[j-1][i]),
+          ux_N = 0.25*dhx*(x[j][i+1]+x[j+1][i+1]-x[j][i-1]-x[j+1][i-1]),
+          uy_N = dhy*(x[j+1][i]-x[j][i]),
+          ux_S = 0.25*dhx*(x[j-1][i+1]+x[j][i+1]-x[j-1][i-1]-x[j][i-1]),
+          uy_S = dhy*(x[j][i]-x[j-1][i]),
+          e_E  = cache ? cache->ex[PBRATU_XFACE(cache,i,j)]    : eta(user,ux_E,uy_E),
+          e_W  = cache ? cache->ex[PBRATU_XFACE(cache,i-1,j)]  : eta(user,ux_W,uy_W),
+          e_N  = cache ? cache->ey[PBRATU_YFACE(cache,i,j)]    : eta(user,ux_N,uy_N),
+          e_S  = cache ? cache->ey[PBRATU_YFACE(cache,i,j-1)]  : eta(user,ux_S,uy_S),
+          de_E = cache ? cache->dex[PBRATU_XFACE(cache,i,j)]   : deta(user,ux_E,uy_E),
+          de_W = cache ? cache->dex[PBRATU_XFACE(cache,i-1,j)] : deta(user,ux_W,uy_W),
+          de_N = cache ? cache->dey[PBRATU_YFACE(cache,i,j)]   : deta(user,ux_N,uy_N),
+          de_S = cache ? cache->dey[PBRATU_YFACE(cache,i,j-1)] : deta(user,ux_S,uy_S),
+          /* derivatives of the face fluxes with respect to the normal (n) and tangential (t) gradient */
+          fn_E = -hy*(e_E + de_E*ux_E*ux_E)*dhx,
+          ft_E = -hy*de_E*ux_E*uy_E*0.25*dhy,
+          fn_W =  hy*(e_W + de_W*ux_W*ux_W)*dhx,
+          ft_W =  hy*de_W*ux_W*uy_W*0.25*dhy,
+          fn_N = -hx*(e_N + de_N*uy_N*uy_N)*dhy,
+          ft_N = -hx*de_N*ux_N*uy_N*0.25*dhx,
+          fn_S =  hx*(e_S + de_S*uy_S*uy_S)*dhy,
+          ft_S =  hx*de_S*ux_S*uy_S*0.25*dhx;
+        PetscInt k,l,n;
+
+        /* v[dj+1][di+1] is the derivative of f[j][i] with respect to x[j+dj][i+di] */
+        ierr = PetscMemzero(v,sizeof(v));CHKERRQ(ierr);
+        /* east face */
+        v[1][2] += fn_E; v[1][1] -= fn_E;
+        v[2][1] += ft_E; v[2][2] += ft_E; v[0][1] -= ft_E; v[0][2] -= ft_E;
+        /* west face */
+        v[1][1] += fn_W; v[1][0] -= fn_W;
+        v[2][0] += ft_W; v[2][1] += ft_W; v[0][0] -= ft_W; v[0][1] -= ft_W;
+        /* north face */
+        v[2][1] += fn_N; v[1][1] -= fn_N;
+        v[1][2] += ft_N; v[2][2] += ft_N; v[1][0] -= ft_N; v[2][0] -= ft_N;
+        /* south face */
+        v[1][1] += fn_S; v[0][1] -= fn_S;
+        v[0][2] += ft_S; v[1][2] += ft_S; v[0][0] -= ft_S; v[1][0] -= ft_S;
+        /* Bratu source */
+        v[1][1] -= sc*PetscExpScalar(x[j][i]);
+        /*
+           On a Neumann side the ghost column is the mirror image of the opposite column
+           (MirrorGhosts()) and the row is halved (NeumannRows()); the matrix of the
+           DM_BOUNDARY_GHOSTED DMDA ignores the ghost columns, now zero
+        */
+        if (info->bx == DM_BOUNDARY_GHOSTED && (i == 0 || i == info->mx-1)) {
+          const PetscInt g = i ? 2 : 0;
+          for (k=0; k<3; k++) {v[k][2-g] += v[k][g]; v[k][g] = 0;}
+          for (k=0; k<3; k++) for (l=0; l<3; l++) v[k][l] *= 0.5;
+        }
+        if (info->by == DM_BOUNDARY_GHOSTED && (j == 0 || j == info->my-1)) {
+          const PetscInt g = j ? 2 : 0;
+          for (l=0; l<3; l++) {v[2-g][l] += v[g][l]; v[g][l] = 0;}
+          for (k=0; k<3; k++) for (l=0; l<3; l++) v[k][l] *= 0.5;
+        }
+
+        for (k=0,n=0; k<3; k++) {
+          for (l=0; l<3; l++,n++) {
+            col[n].j = j+k-1; col[n].i = i+l-1;
+          }
+        }
+        ierr = MatSetValuesStencil(B,1,&row,9,col,&v[0][0],INSERT_VALUES);CHKERRQ(ierr);
+      }
+    }
+  }
+
+  /*
+     Assemble matrix, using the 2-step process:
+       MatAssemblyBegin(), MatAssemblyEnd().
+  */
+  ierr = MatAssemblyBegin(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  /*
+     Tell the matrix we will never add a new nonzero location to the
+     matrix. If we do, it will generate an error.
+  */
+  ierr = MatSetOption(B,MAT_NEW_NONZERO_LOCATION_ERR,PETSC_TRUE);CHKERRQ(ierr);
+  ierr = PetscLogFlops((cache ? 107.0 : 155.0)*InteriorPoints(info));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianPicardLocal"
+/*
+   FormJacobianPicardLocal - Evaluates the Picard operator of the p-Bratu residual (-pbratu_picard)
+
+   The diffusivity of each face flux is frozen at x, so that the flux is linear
+   in the normal difference, eta*u_n: the operator is the 5-point
+   -div(eta grad .) with the linearized Bratu term on the diagonal, symmetric and,
+   for lambda = 0, positive definite.  The values
+   are inserted into the 9-point pattern of the DMDA matrix, with zeros at the
+   corners, so the matrix is the same one Newton uses, updated in place.  Once
+   PicardMonitor() has switched the solve to Newton, FormJacobianLocal() is
+   used instead.
+ */
+static PetscErrorCode FormJacobianPicardLocal(DMDALocalInfo *info,PetscScalar **x,Mat J,Mat B,AppCtx *user)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = AssemblePicard(info,x,J,B,user,PETSC_NULL);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "AssemblePicard"
+/*
+   AssemblePicard - FormJacobianPicardLocal(), with the face diffusivities taken from the cache when it is not NULL
+ */
+static PetscErrorCode AssemblePicard(DMDALocalInfo *info,PetscScalar **x,Mat J,Mat B,AppCtx *user,const EtaCache *cache)
+{
+  PetscReal      hx,hy,dhx,dhy,sc,hxdhy,hydhx;
   PetscInt       i,j;
+  PetscScalar    v[3][3];
+  MatStencil     row,col[9];
+  PetscErrorCode ierr;
 
   PetscFunctionBegin;
+  if (user->picard.newton) {
+    ierr = AssembleJacobian(info,x,J,B,user,cache);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+  ierr  = PetscLogEventBegin(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
   hx    = 1./(PetscReal)(info->mx-1);
   hy    = 1./(PetscReal)(info->my-1);
+  sc    = hx*hy*user->lambda;
+  dhx   = 1/hx;
+  dhy   = 1/hy;
   hxdhy = hx/hy;
   hydhx = hy/hx;
-  /*
-     Compute function over the locally owned part of the grid
-  */
   for (j=info->ys; j<info->ys+info->ym; j++) {
     for (i=info->xs; i<info->xs+info->xm; i++) {
+      row.j = j; row.i = i;
       if (i == 0 || j == 0 || i == info->mx-1 || j == info->my-1) {
-        f[j][i] = x[j][i];      /* homogeneous Dirichlet boundary condition */
+        const PetscScalar one = 1.0;
+        /* homogeneous Dirichlet boundary condition */
+        ierr = MatSetValuesStencil(B,1,&row,1,&row,&one,INSERT_VALUES);CHKERRQ(ierr);
       } else {
         const PetscScalar
-          u = x[j][i],
-          uxx = (2.0*u - x[j][i-1] - x[j][i+1])*hydhx,
-          uyy = (2.0*u - x[j-1][i] - x[j+1][i])*hxdhy;
-        f[j][i] = uxx + uyy;
+          e_E = hydhx*(cache ? cache->ex[PBRATU_XFACE(cache,i,j)]
+                             : eta(user,dhx*(x[j][i+1]-x[j][i]),0.25*dhy*(x[j+1][i]+x[j+1][i+1]-x[j-1][i]-x[j-1][i+1]))),
+          e_W = hydhx*(cache ? cache->ex[PBRATU_XFACE(cache,i-1,j)]
+                             : eta(user,dhx*(x[j][i]-x[j][i-1]),0.25*dhy*(x[j+1][i-1]+x[j+1][i]-x[j-1][i-1]-x[j-1][i]))),
+          e_N = hxdhy*(cache ? cache->ey[PBRATU_YFACE(cache,i,j)]
+                             : eta(user,0.25*dhx*(x[j][i+1]+x[j+1][i+1]-x[j][i-1]-x[j+1][i-1]),dhy*(x[j+1][i]-x[j][i]))),
+          e_S = hxdhy*(cache ? cache->ey[PBRATU_YFACE(cache,i,j-1)]
+                             : eta(user,0.25*dhx*(x[j-1][i+1]+x[j][i+1]-x[j-1][i-1]-x[j][i-1]),dhy*(x[j][i]-x[j-1][i])));
+        PetscInt k,l,n;
+
+        /* v[dj+1][di+1] is the coefficient of x[j+dj][i+di] in row (i,j) */
+        v[0][0] = 0;    v[0][1] = -e_S; v[0][2] = 0;
+        v[1][0] = -e_W; v[1][2] = -e_E;
+        v[2][0] = 0;    v[2][1] = -e_N; v[2][2] = 0;
+        v[1][1] = e_E + e_W + e_N + e_S - sc*PetscExpScalar(x[j][i]);
+        for (k=0,n=0; k<3; k++) {
+          for (l=0; l<3; l++,n++) {
+            col[n].j = j+k-1; col[n].i = i+l-1;
+          }
+        }
+        ierr = MatSetValuesStencil(B,1,&row,9,col,&v[0][0],INSERT_VALUES);CHKERRQ(ierr);
       }
     }
   }
+  ierr = MatAssemblyBegin(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  ierr = MatSetOption(B,MAT_NEW_NONZERO_LOCATION_ERR,PETSC_TRUE);CHKERRQ(ierr);
+  ierr = PetscLogFlops((cache ? 20.0 : 60.0)*PetscMax(PetscMin(info->xs+info->xm,info->mx-1)-PetscMax(info->xs,1),0)
+                       *PetscMax(PetscMin(info->ys+info->ym,info->my-1)-PetscMax(info->ys,1),0));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PicardMonitor"
+/*
+   PicardMonitor - Switches the current solve from Picard to Newton once ||F|| < rtol ||F_0||
+
+   Runs after every nonlinear iteration, before the next Jacobian evaluation;
+   iteration 0 starts each solve (continuation step, grid sequencing level) in
+   Picard mode.  Also counts the steps taken in each mode.
+ */
+static PetscErrorCode PicardMonitor(SNES snes,PetscInt its,PetscReal fnorm,void *ctx)
+{
+  PicardPolicy   *picard = &((AppCtx*)ctx)->picard;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (!its) {
+    picard->fnorm0 = fnorm;
+    picard->newton = PETSC_FALSE;
+  } else if (picard->newton) {
+    picard->nnewton++;
+  } else {
+    picard->npicard++;
+  }
+  if (!picard->newton && fnorm < picard->rtol*picard->fnorm0) {
+    picard->newton   = PETSC_TRUE;
+    picard->switched = PETSC_TRUE;
+    ierr = PetscInfo2(snes,"Switching from Picard to Newton at iteration %D, ||F|| = %g\n",its,(double)fnorm);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+/*
+   Nonlinear Gauss-Seidel (-snes_type ngs, or the level smoother of -snes_type fas)
+
+   The residual at (i,j) depends on the 3x3 box around it only, and through
+   x[j][i] only via the normal derivatives of its four face fluxes: the
+   tangential derivatives of those faces do not involve x[j][i].  Solving
+   f(x)[j][i] = b[j][i] for x[j][i] with the other points fixed is therefore a
+   scalar equation, solved by Newton's method.
+
+   The points are visited in red-black order, (i+j) even first.  Since the box
+   stencil couples diagonal neighbors, which have the same color, each color
+   is swept in two phases, its points on the even rows and then those on the
+   odd rows; the points of one phase are then mutually independent, so the
+   rows of a phase are divided among the OpenMP threads and each row is
+   updated by unit-stride loops over its points of the phase.
+
+   NGSRow - Newton iterations for the points i = i0, i0+2, ... < ie of row j
+
+   The four neighbors, the tangential derivatives and the right-hand side of
+   each point are gathered from the ghosted array xl into the work array,
+   which must hold PBRATU_NGS_WORK(n) entries for n points; the updated values
+   are stored into x.  A point stops when |f| <= atol, |f| <= rtol |f_0| or
+   |du| <= stol |u|, and the row when all its points have stopped or after
+   maxits iterations.  With eta = g^q, g = epsilon^2 + 1/2 |grad u|^2,
+   q = (p-2)/2, the derivative of the flux eta u_n with respect to u_n is
+   eta (1 + q u_n^2/g), which saves the pow() of deta().  Returns the number
+   of point updates.
+*/
+#define PBRATU_NGS_WORK(n) (12*(n))
+static PetscInt NGSRow(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **xl,PetscScalar **x,PetscScalar **b,
+                       PetscInt j,PetscInt i0,PetscInt ie,PetscInt maxits,PetscReal atol,PetscReal rtol,PetscReal stol,PetscScalar *work)
+{
+  const PetscReal hx = GridSpacing(info->mx,info->bx),hy = GridSpacing(info->my,info->by);
+  const PetscReal sc = hx*hy*user->lambda,dhx = 1/hx,dhy = 1/hy,hxdhy = hx/hy,hydhx = hy/hx;
+  const PetscReal e2 = PetscSqr(user->epsilon),q = 0.5*(user->p-2.);
+  const PetscInt  n  = ie > i0 ? (ie-i0+1)/2 : 0;
+  PetscScalar     *PETSC_RESTRICT u  = work,     *PETSC_RESTRICT xE = work+n,  *PETSC_RESTRICT xW = work+2*n,
+                  *PETSC_RESTRICT xN = work+3*n, *PETSC_RESTRICT xS = work+4*n,*PETSC_RESTRICT tE = work+5*n,
+                  *PETSC_RESTRICT tW = work+6*n, *PETSC_RESTRICT tN = work+7*n,*PETSC_RESTRICT tS = work+8*n,
+                  *PETSC_RESTRICT rb = work+9*n, *PETSC_RESTRICT f0 = work+10*n,*PETSC_RESTRICT act = work+11*n;
+  PetscInt        k,l,nact = n,nits = 0;
+
+  for (k=0; k<n; k++) {
+    const PetscInt i = i0+2*k;
+
+    u[k]   = xl[j][i];
+    xE[k]  = xl[j][i+1]; xW[k] = xl[j][i-1];
+    xN[k]  = xl[j+1][i]; xS[k] = xl[j-1][i];
+    tE[k]  = 0.25*dhy*(xl[j+1][i]+xl[j+1][i+1]-xl[j-1][i]-xl[j-1][i+1]);
+    tW[k]  = 0.25*dhy*(xl[j+1][i-1]+xl[j+1][i]-xl[j-1][i-1]-xl[j-1][i]);
+    tN[k]  = 0.25*dhx*(xl[j][i+1]+xl[j+1][i+1]-xl[j][i-1]-xl[j+1][i-1]);
+    tS[k]  = 0.25*dhx*(xl[j-1][i+1]+xl[j][i+1]-xl[j-1][i-1]-xl[j][i-1]);
+    rb[k]  = b ? b[j][i] : 0;
+    act[k] = 1;
+  }
+  for (l=0; l<maxits && nact; l++) {
+    nits += nact;
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) {
+      const PetscScalar
+        uxE = dhx*(xE[k]-u[k]), uxW = dhx*(u[k]-xW[k]),
+        uyN = dhy*(xN[k]-u[k]), uyS = dhy*(u[k]-xS[k]),
+        gE  = e2+0.5*(uxE*uxE + tE[k]*tE[k]), gW = e2+0.5*(uxW*uxW + tW[k]*tW[k]),
+        gN  = e2+0.5*(tN[k]*tN[k] + uyN*uyN), gS = e2+0.5*(tS[k]*tS[k] + uyS*uyS),
+        eE  = PetscPowScalar(gE,q), eW = PetscPowScalar(gW,q),
+        eN  = PetscPowScalar(gN,q), eS = PetscPowScalar(gS,q),
+        br  = sc*PetscExpScalar(u[k]),
+        F   = -hy*(eE*uxE - eW*uxW) - hx*(eN*uyN - eS*uyS) - br - rb[k],
+        dF  = hydhx*(eE*(1 + q*uxE*uxE/gE) + eW*(1 + q*uxW*uxW/gW))
+              + hxdhy*(eN*(1 + q*uyN*uyN/gN) + eS*(1 + q*uyS*uyS/gS)) - br,
+        du  = act[k]*F/dF;
+      const PetscReal fa = PetscAbsScalar(F);
+
+      f0[k]  = l ? f0[k] : fa;
+      u[k]  -= du;
+      act[k] = (fa <= atol || fa <= rtol*PetscRealPart(f0[k]) || PetscAbsScalar(du) <= stol*PetscAbsScalar(u[k])) ? 0 : act[k];
+    }
+    for (k=0,nact=0; k<n; k++) nact += (act[k] != (PetscScalar)0);
+  }
+  for (k=0; k<n; k++) x[j][i0+2*k] = u[k];
+  return nits;
+}
+
+/*
+   NGSRows - One phase of the red-black sweep on the owned rows j0 <= j < j1: the interior points
+   with i+j = color (mod 2) on the rows with j = row (mod 2)
+*/
+static PetscInt NGSRows(const DMDALocalInfo *info,const AppCtx *user,PetscScalar **xl,PetscScalar **x,PetscScalar **b,PetscInt j0,PetscInt j1,
+                        PetscInt color,PetscInt row,PetscInt maxits,PetscReal atol,PetscReal rtol,PetscReal stol,PetscScalar *work)
+{
+  const PetscInt is = PetscMax(info->xs,1),ie = PetscMin(info->xs+info->xm,info->mx-1);
+  PetscInt       j,nits = 0;
+
+  for (j=PetscMax(j0,1); j<PetscMin(j1,info->my-1); j++) {
+    if (j % 2 != row) continue;
+    nits += NGSRow(info,user,xl,x,b,j,is+(is+j+color)%2,ie,maxits,atol,rtol,stol,work);
+  }
+  return nits;
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "NonlinearGS"
+/*
+   NonlinearGS - Red-black nonlinear Gauss-Seidel sweeps for F(X) = B (B = 0 when NULL), the SNESNGS
+   callback installed with DMSNESSetNGS()
+
+   The number of sweeps and the tolerances of the pointwise Newton iterations
+   are those of SNESNGSSetSweeps() and SNESNGSSetTolerances(), e.g.
+   -fas_levels_snes_ngs_sweeps and -fas_levels_snes_ngs_max_it.  The ghost
+   points are updated before each of the four phases of a sweep, so the result
+   does not depend on the parallel decomposition.  The Dirichlet points are set
+   to B before the first update, so the points next to them are relaxed against
+   the boundary values.  Logged as the event PBratuNGS.
+ */
+static PetscErrorCode NonlinearGS(SNES snes,Vec X,Vec B,void *ctx)
+{
+  AppCtx         *user = (AppCtx*)ctx;
+  DM             dm;
+  DMDALocalInfo  info;
+  Vec            Xloc;
+  PetscScalar    **xl,**x,**b = PETSC_NULL,*work;
+  PetscInt       sweeps,maxits,s,c,i,j,nin,nwork,nt = 1;
+  PetscReal      atol,rtol,stol;
+  PetscLogDouble nits = 0;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = SNESNGSGetSweeps(snes,&sweeps);CHKERRQ(ierr);
+  ierr = SNESNGSGetTolerances(snes,&atol,&rtol,&stol,&maxits);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(NGSEvent,dm,X,B,0);CHKERRQ(ierr);
+  nin   = PetscMax(PetscMin(info.xs+info.xm,info.mx-1) - PetscMax(info.xs,1),0);
+  nwork = PBRATU_NGS_WORK((nin+1)/2);
+#if defined(_OPENMP)
+  nt    = omp_get_max_threads();
+#endif
+  ierr = DMGetWorkArray(dm,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(dm,X,&x);CHKERRQ(ierr);
+  if (B) {ierr = DMDAVecGetArrayRead(dm,B,&b);CHKERRQ(ierr);}
+  for (j=info.ys; j<info.ys+info.ym; j++) {
+    for (i=info.xs; i<info.xs+info.xm; i++) {
+      if (i == 0 || j == 0 || i == info.mx-1 || j == info.my-1) x[j][i] = b ? b[j][i] : 0;
+    }
+  }
+  if (B) {ierr = DMDAVecRestoreArrayRead(dm,B,&b);CHKERRQ(ierr);}
+  ierr = DMDAVecRestoreArray(dm,X,&x);CHKERRQ(ierr);
+  for (s=0; s<sweeps; s++) {
+    for (c=0; c<4; c++) {
+      ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+      ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+      ierr = DMDAVecGetArrayRead(dm,Xloc,&xl);CHKERRQ(ierr);
+      ierr = DMDAVecGetArray(dm,X,&x);CHKERRQ(ierr);
+      if (B) {ierr = DMDAVecGetArrayRead(dm,B,&b);CHKERRQ(ierr);}
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(nt) reduction(+:nits)
+      {
+        PetscInt j0,j1;
+
+        RowPartition(info.ys,info.ym,omp_get_num_threads(),omp_get_thread_num(),&j0,&j1);
+        nits += NGSRows(&info,user,xl,x,b,j0,j1,c/2,c%2,maxits,atol,rtol,stol,work+omp_get_thread_num()*nwork);
+      }
+#else
+      nits += NGSRows(&info,user,xl,x,b,info.ys,info.ys+info.ym,c/2,c%2,maxits,atol,rtol,stol,work);
+#endif
+      if (B) {ierr = DMDAVecRestoreArrayRead(dm,B,&b);CHKERRQ(ierr);}
+      ierr = DMDAVecRestoreArray(dm,X,&x);CHKERRQ(ierr);
+      ierr = DMDAVecRestoreArrayRead(dm,Xloc,&xl);CHKERRQ(ierr);
+    }
+  }
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMRestoreWorkArray(dm,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+  ierr = PetscLogFlops(75.0*nits + 20.0*sweeps*nin*PetscMax(PetscMin(info.ys+info.ym,info.my-1)-PetscMax(info.ys,1),0));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(NGSEvent,dm,X,B,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+/*
+   3D variant (-pbratu_dim 3)
+
+   The box stencil of DMDACreate3d() couples each point to 18 of its 26 neighbors through
+   the face fluxes below.
+
+   FaceFluxRow3d - diffusive fluxes eta*u_n through n consecutive faces of one orientation
+
+   For face k, the normal derivative is u_n = dn*(c1[k]-c0[k]); each tangential
+   derivative is averaged over the four points adjacent to the face, e.g.
+   u_t1 = 1/4 d1 (p0[k]+p1[k]-m0[k]-m1[k]), with p0, p1 the points on both sides
+   of the face shifted by +1 in the tangential direction, and m0, m1 by -1.
+*/
+static void FaceFluxRow3d(const AppCtx *ctx,PetscInt n,PetscReal dn,const PetscScalar *PETSC_RESTRICT c0,const PetscScalar *PETSC_RESTRICT c1,
+                          PetscReal d1,const PetscScalar *PETSC_RESTRICT p0,const PetscScalar *PETSC_RESTRICT p1,const PetscScalar *PETSC_RESTRICT m0,const PetscScalar *PETSC_RESTRICT m1,
+                          PetscReal d2,const PetscScalar *PETSC_RESTRICT q0,const PetscScalar *PETSC_RESTRICT q1,const PetscScalar *PETSC_RESTRICT r0,const PetscScalar *PETSC_RESTRICT r1,
+                          PetscScalar *PETSC_RESTRICT flux)
+{
+  const PetscReal e2 = PetscSqr(ctx->epsilon),q = 0.5*(ctx->p-2.),t1 = 0.25*d1,t2 = 0.25*d2;
+  PetscInt        k;
+
+  if (ctx->p == 2) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) flux[k] = dn*(c1[k]-c0[k]);
+    return;
+  }
+#if defined(PBRATU_HAVE_FASTMATH)
+  if (ctx->fastmath) {
+    PBRATU_PRAGMA_OMP_SIMD
+    for (k=0; k<n; k++) {
+      const PetscScalar
+        un  = dn*(c1[k]-c0[k]),
+        ut1 = t1*(p0[k]+p1[k]-m0[k]-m1[k]),
+        ut2 = t2*(q0[k]+q1[k]-r0[k]-r1[k]);
+      flux[k] = FastPow(e2+0.5*(un*un + ut1*ut1 + ut2*ut2),q)*un;
+    }
+    return;
+  }
+#endif
+  PBRATU_PRAGMA_OMP_SIMD
+  for (k=0; k<n; k++) {
+    const PetscScalar
+      un  = dn*(c1[k]-c0[k]),
+      ut1 = t1*(p0[k]+p1[k]-m0[k]-m1[k]),
+      ut2 = t2*(q0[k]+q1[k]-r0[k]-r1[k]);
+    flux[k] = PetscPowScalar(e2+0.5*(un*un + ut1*ut1 + ut2*ut2),q)*un;
+  }
+}
+
+/*
+   ResidualBlock3d - Evaluates the 3D residual at the interior points is <= i < ie, js <= j < je, ks <= k < ke.
+
+   As in ResidualBlock_Scalar(), every face flux is computed once: the x-faces of
+   the current row into fx, the y-faces of the current plane into fy (one row of
+   faces more than rows of points), and the z-faces below and above the current
+   plane into fzD and fzU, which are swapped from plane to plane.  work must hold
+   PBRATU_BLOCK3D_WORK(ie-is,je-js) entries.
+*/
+#define PBRATU_BLOCK3D_WORK(n,m) ((n)+1 + (n)*((m)+1) + 2*(n)*(m))
+static void ResidualBlock3d(const DMDALocalInfo *info,const AppCtx *user,PetscScalar ***x,PetscScalar ***f,
+                            PetscInt is,PetscInt ie,PetscInt js,PetscInt je,PetscInt ks,PetscInt ke,PetscScalar *work)
+{
+  const PetscInt  n = ie-is,m = je-js;
+  const PetscReal hx = 1./(PetscReal)(info->mx-1),hy = 1./(PetscReal)(info->my-1),hz = 1./(PetscReal)(info->mz-1),
+                  dhx = 1/hx,dhy = 1/hy,dhz = 1/hz,ayz = hy*hz,axz = hx*hz,axy = hx*hy,sc = hx*hy*hz*user->lambda;
+  PetscScalar     *fx = work,*fy = fx+n+1,*fzD = fy+n*(m+1),*fzU = fzD+n*m,*t;
+  PetscInt        j,k,l,r;
+
+  if (n <= 0 || m <= 0 || ks >= ke) return;
+  for (j=js,r=0; j<je; j++,r++) {
+    k = ks-1;
+    FaceFluxRow3d(user,n,dhz,x[k][j]+is,x[k+1][j]+is,dhx,x[k][j]+is+1,x[k+1][j]+is+1,x[k][j]+is-1,x[k+1][j]+is-1,
+                  dhy,x[k][j+1]+is,x[k+1][j+1]+is,x[k][j-1]+is,x[k+1][j-1]+is,fzD+r*n);
+  }
+  for (k=ks; k<ke; k++) {
+    for (j=js-1,r=0; j<je; j++,r++) {
+      FaceFluxRow3d(user,n,dhy,x[k][j]+is,x[k][j+1]+is,dhx,x[k][j]+is+1,x[k][j+1]+is+1,x[k][j]+is-1,x[k][j+1]+is-1,
+                    dhz,x[k+1][j]+is,x[k+1][j+1]+is,x[k-1][j]+is,x[k-1][j+1]+is,fy+r*n);
+    }
+    for (j=js,r=0; j<je; j++,r++) {
+      FaceFluxRow3d(user,n,dhz,x[k][j]+is,x[k+1][j]+is,dhx,x[k][j]+is+1,x[k+1][j]+is+1,x[k][j]+is-1,x[k+1][j]+is-1,
+                    dhy,x[k][j+1]+is,x[k+1][j+1]+is,x[k][j-1]+is,x[k+1][j-1]+is,fzU+r*n);
+    }
+    for (j=js,r=0; j<je; j++,r++) {
+      const PetscScalar *PETSC_RESTRICT xc = x[k][j]+is,*PETSC_RESTRICT fyS = fy+r*n,*PETSC_RESTRICT fyN = fyS+n,
+                        *PETSC_RESTRICT fzd = fzD+r*n,*PETSC_RESTRICT fzu = fzU+r*n;
+      PetscScalar       *PETSC_RESTRICT fr = f[k][j]+is;
+
+      FaceFluxRow3d(user,n+1,dhx,x[k][j]+is-1,x[k][j]+is,dhy,x[k][j+1]+is-1,x[k][j+1]+is,x[k][j-1]+is-1,x[k][j-1]+is,
+                    dhz,x[k+1][j]+is-1,x[k+1][j]+is,x[k-1][j]+is-1,x[k-1][j]+is,fx);
+      PBRATU_PRAGMA_OMP_SIMD
+      for (l=0; l<n; l++) fr[l] = -ayz*(fx[l+1]-fx[l]) - axz*(fyN[l]-fyS[l]) - axy*(fzu[l]-fzd[l]);
+      if (sc) BratuRow(user,n,sc,xc,fr);
+    }
+    t = fzD; fzD = fzU; fzU = t;
+  }
+}
+
+/*
+   FormFunctionPlanes3d - Evaluates F(x) on the owned points of the planes k0 <= k < k1
+*/
+static void FormFunctionPlanes3d(const DMDALocalInfo *info,const AppCtx *user,PetscScalar ***x,PetscScalar ***f,PetscInt k0,PetscInt k1,PetscScalar *work)
+{
+  const PetscInt xs = info->xs,xe = info->xs+info->xm,ys = info->ys,ye = info->ys+info->ym;
+  PetscInt       i,j,k;
+
+  /*
+     Homogeneous Dirichlet boundary condition on the locally owned part of the boundary
+  */
+  for (k=k0; k<k1; k++) {
+    for (j=ys; j<ye; j++) {
+      if (k == 0 || k == info->mz-1 || j == 0 || j == info->my-1) {
+        for (i=xs; i<xe; i++) f[k][j][i] = x[k][j][i];
+      } else {
+        if (xs == 0)        f[k][j][0]          = x[k][j][0];
+        if (xe == info->mx) f[k][j][info->mx-1] = x[k][j][info->mx-1];
+      }
+    }
+  }
+  ResidualBlock3d(info,user,x,f,PetscMax(xs,1),PetscMin(xe,info->mx-1),PetscMax(ys,1),PetscMin(ye,info->my-1),
+                  PetscMax(k0,1),PetscMin(k1,info->mz-1),work);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormFunctionLocal3d"
+/*
+   FormFunctionLocal3d - Evaluates nonlinear function, F(x), in 3D
+
+   With OpenMP the owned planes are divided among the threads with RowPartition().
+ */
+static PetscErrorCode FormFunctionLocal3d(DMDALocalInfo *info,PetscScalar ***x,PetscScalar ***f,AppCtx *user)
+{
+  PetscInt       nx,ny,nwork,nt = 1;
+  PetscScalar    *work;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr  = PetscLogEventBegin(ResidualEvent,info->da,0,0,0);CHKERRQ(ierr);
+  nx    = PetscMax(PetscMin(info->xs+info->xm,info->mx-1) - PetscMax(info->xs,1),0);
+  ny    = PetscMax(PetscMin(info->ys+info->ym,info->my-1) - PetscMax(info->ys,1),0);
+  nwork = PBRATU_BLOCK3D_WORK(nx,ny);
+#if defined(_OPENMP)
+  nt    = omp_get_max_threads();
+#endif
+  ierr = DMGetWorkArray(info->da,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(nt)
+  {
+    PetscInt k0,k1;
+
+    RowPartition(info->zs,info->zm,omp_get_num_threads(),omp_get_thread_num(),&k0,&k1);
+    FormFunctionPlanes3d(info,user,x,f,k0,k1,work+omp_get_thread_num()*nwork);
+  }
+#else
+  FormFunctionPlanes3d(info,user,x,f,info->zs,info->zs+info->zm,work);
+#endif
+  ierr = DMRestoreWorkArray(info->da,nt*nwork,MPIU_SCALAR,&work);CHKERRQ(ierr);
+  ierr = PetscLogFlops(ResidualFlops(info,user));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(ResidualEvent,info->da,0,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/*
+   JacobianFace3d - Adds the derivatives of the flux through one face of point (i,j,k) to v
+
+   The face is normal to direction a, on the side s = -1 or +1; L and H are the
+   offsets of the two points on either side of the face.  v[dk+1][dj+1][di+1] is the
+   derivative of f[k][j][i] with respect to x[k+dk][j+dj][i+di].
+*/
+static void JacobianFace3d(const AppCtx *user,PetscScalar ***x,PetscInt i,PetscInt j,PetscInt k,PetscInt a,PetscInt s,
+                           const PetscReal dh[3],PetscReal area,PetscScalar v[3][3][3])
+{
+  const PetscReal q = 0.5*(user->p-2.);
+  PetscInt        L[3] = {0,0,0},H[3] = {0,0,0},b,t,sb;
+  PetscScalar     u[3],g,e,de,w,c;
+
+#define X3(o,b,sb) x[k+(o)[2]+((b) == 2)*(sb)][j+(o)[1]+((b) == 1)*(sb)][i+(o)[0]+((b) == 0)*(sb)]
+#define V3(o,b,sb) v[(o)[2]+((b) == 2)*(sb)+1][(o)[1]+((b) == 1)*(sb)+1][(o)[0]+((b) == 0)*(sb)+1]
+  if (s < 0) L[a] = -1;
+  else       H[a] = 1;
+  u[a] = dh[a]*(X3(H,a,0)-X3(L,a,0));
+  for (t=1; t<3; t++) {
+    b    = (a+t)%3;
+    u[b] = 0.25*dh[b]*(X3(H,b,1)+X3(L,b,1)-X3(H,b,-1)-X3(L,b,-1));
+  }
+  g  = PetscSqr(user->epsilon) + 0.5*(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+  e  = PetscPowScalar(g,q);
+  de = user->p == 2 ? 0 : q*PetscPowScalar(g,q-1);
+  /* f gets -area*flux through the face on the + side, +area*flux on the - side */
+  w  = -s*area;
+  c  = w*(e + de*u[a]*u[a])*dh[a];
+  V3(H,a,0) += c; V3(L,a,0) -= c;
+  for (t=1; t<3; t++) {
+    b = (a+t)%3;
+    c = w*de*u[a]*u[b]*0.25*dh[b];
+    for (sb=-1; sb<=1; sb+=2) {
+      V3(H,b,sb) += sb*c; V3(L,b,sb) += sb*c;
+    }
+  }
+#undef X3
+#undef V3
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianLocal3d"
+/*
+   FormJacobianLocal3d - Evaluates the Jacobian matrix of the 3D p-Bratu operator.
+
+   Each row couples the point to the 18 neighbors that share a face or an edge
+   with it; the 27-point rows of the box stencil are set whole, with zeros at the
+   corners, so that the nonzero pattern is that of the DMDA's matrix.
+ */
+static PetscErrorCode FormJacobianLocal3d(DMDALocalInfo *info,PetscScalar ***x,Mat J,Mat B,AppCtx *user)
+{
+  PetscReal      dh[3],area[3],sc;
+  PetscInt       i,j,k,a,di,dj,dk,n;
+  PetscScalar    v[3][3][3];
+  MatStencil     row,col[27];
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr    = PetscLogEventBegin(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  dh[0]   = info->mx-1;
+  dh[1]   = info->my-1;
+  dh[2]   = info->mz-1;
+  area[0] = 1/(dh[1]*dh[2]);
+  area[1] = 1/(dh[0]*dh[2]);
+  area[2] = 1/(dh[0]*dh[1]);
+  sc      = user->lambda/(dh[0]*dh[1]*dh[2]);
+  for (k=info->zs; k<info->zs+info->zm; k++) {
+    for (j=info->ys; j<info->ys+info->ym; j++) {
+      for (i=info->xs; i<info->xs+info->xm; i++) {
+        row.k = k; row.j = j; row.i = i;
+        if (i == 0 || j == 0 || k == 0 || i == info->mx-1 || j == info->my-1 || k == info->mz-1) {
+          const PetscScalar one = 1.0;
+          /* homogeneous Dirichlet boundary condition */
+          ierr = MatSetValuesStencil(B,1,&row,1,&row,&one,INSERT_VALUES);CHKERRQ(ierr);
+          continue;
+        }
+        ierr = PetscMemzero(v,sizeof(v));CHKERRQ(ierr);
+        for (a=0; a<3; a++) {
+          JacobianFace3d(user,x,i,j,k,a,-1,dh,area[a],v);
+          JacobianFace3d(user,x,i,j,k,a,1,dh,area[a],v);
+        }
+        /* Bratu source */
+        v[1][1][1] -= sc*PetscExpScalar(x[k][j][i]);
+        for (dk=0,n=0; dk<3; dk++) {
+          for (dj=0; dj<3; dj++) {
+            for (di=0; di<3; di++,n++) {
+              col[n].k = k+dk-1; col[n].j = j+dj-1; col[n].i = i+di-1;
+            }
+          }
+        }
+        ierr = MatSetValuesStencil(B,1,&row,27,col,&v[0][0][0],INSERT_VALUES);CHKERRQ(ierr);
+      }
+    }
+  }
+  ierr = MatAssemblyBegin(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  ierr = MatSetOption(B,MAT_NEW_NONZERO_LOCATION_ERR,PETSC_TRUE);CHKERRQ(ierr);
+  ierr = PetscLogFlops(350.0*PetscMax(PetscMin(info->xs+info->xm,info->mx-1)-PetscMax(info->xs,1),0)
+                       *PetscMax(PetscMin(info->ys+info->ym,info->my-1)-PetscMax(info->ys,1),0)
+                       *PetscMax(PetscMin(info->zs+info->zm,info->mz-1)-PetscMax(info->zs,1),0));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "FormFunctionColoring"
+/*
+   FormFunctionColoring - Residual evaluation of the finite-difference Jacobian, through the
+   SNES so that the evaluations are counted and use the residual routine of its current DM
+ */
+static PetscErrorCode FormFunctionColoring(SNES snes,Vec X,Vec F,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESComputeFunction(snes,X,F);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianColoring"
+/*
+   FormJacobianColoring - Finite-difference Jacobian (-pbratu_jacobian_type fd) by coloring
+
+   The coloring of the DMDA's box stencil (9 colors in 2D, 27 in 3D) and the
+   MatFDColoring built from it are created at the first call for a matrix and
+   composed with it, so they are reused for every later Newton and
+   continuation step on the same grid.  Each multigrid level has its own.  On
+   the SNES's own DM, F(x) is already known and is passed to the coloring, so
+   a Jacobian costs one residual evaluation per color.
+ */
+static PetscErrorCode FormJacobianColoring(SNES snes,Vec X,Mat J,Mat B,void *ctx)
+{
+  AppCtx         *user = (AppCtx*)ctx;
+  MatFDColoring  color;
+  ISColoring     iscoloring;
+  DM             dm;
+  Vec            sol,F;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectQuery((PetscObject)B,"PBratuMatFDColoring",(PetscObject*)&color);CHKERRQ(ierr);
+  if (!color) {
+    ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+    ierr = DMCreateColoring(dm,IS_COLORING_GLOBAL,&iscoloring);CHKERRQ(ierr);
+    ierr = MatFDColoringCreate(B,iscoloring,&color);CHKERRQ(ierr);
+    ierr = MatFDColoringSetFunction(color,(PetscErrorCode (*)(void))FormFunctionColoring,PETSC_NULL);CHKERRQ(ierr);
+    ierr = MatFDColoringSetFromOptions(color);CHKERRQ(ierr);
+    ierr = MatFDColoringSetUp(B,iscoloring,color);CHKERRQ(ierr);
+    ierr = ISColoringGetIS(iscoloring,&user->ncolors,PETSC_NULL);CHKERRQ(ierr);
+    ierr = PetscInfo1(snes,"Finite-difference Jacobian with %D colors\n",user->ncolors);CHKERRQ(ierr);
+    ierr = ISColoringDestroy(&iscoloring);CHKERRQ(ierr);
+    ierr = PetscObjectCompose((PetscObject)B,"PBratuMatFDColoring",(PetscObject)color);CHKERRQ(ierr);
+    ierr = MatFDColoringDestroy(&color);CHKERRQ(ierr);
+    ierr = PetscObjectQuery((PetscObject)B,"PBratuMatFDColoring",(PetscObject*)&color);CHKERRQ(ierr);
+  }
+  ierr = SNESGetSolution(snes,&sol);CHKERRQ(ierr);
+  if (X == sol) {
+    ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+    ierr = MatFDColoringSetF(color,F);CHKERRQ(ierr);
+  }
+  ierr = MatFDColoringApply(B,color,X,snes);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+   PBRATU_SHELL_SET - Stores coefficient v at index k of array a of the matrix-free Jacobian,
+   in the precision of the shell
+*/
+#define PBRATU_SHELL_SET(shell,a,k,v) do {              \
+    if ((shell)->single) (shell)->s##a[k] = (float)(v); \
+    else                 (shell)->a[k]    = (v);        \
+  } while (0)
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianShellLocal"
+/*
+   FormJacobianShellLocal - Caches the coefficients of the matrix-free Jacobian at x
+
+   The face coefficients are the derivatives of the face fluxes of FormJacobianLocal(),
+   each computed once per face, and rounded to float for a single precision shell.
+   Matrices that are not shells, such as the assembled coarse-level operators of
+   geometric multigrid, are passed to FormJacobianLocal().
+ */
+static PetscErrorCode FormJacobianShellLocal(DMDALocalInfo *info,PetscScalar **x,Mat J,Mat B,AppCtx *user)
+{
+  JacobianShell  *shell;
+  PetscReal      hx,hy,dhx,dhy,sc;
+  PetscInt       i,j,r,ni;
+  PetscBool      isshell;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectTypeCompare((PetscObject)B,MATSHELL,&isshell);CHKERRQ(ierr);
+  if (!isshell) {
+    ierr = FormJacobianLocal(info,x,J,B,user);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+  ierr = PetscLogEventBegin(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  ierr = MatShellGetContext(B,&shell);CHKERRQ(ierr);
+  hx  = 1./(PetscReal)(info->mx-1);
+  hy  = 1./(PetscReal)(info->my-1);
+  sc  = hx*hy*user->lambda;
+  dhx = 1/hx;
+  dhy = 1/hy;
+  ni  = shell->ie-shell->is;
+  for (j=shell->js,r=0; j<shell->je; j++,r++) {
+    for (i=shell->is-1; i<shell->ie; i++) {
+      const PetscScalar
+        ux = dhx*(x[j][i+1]-x[j][i]),
+        uy = 0.25*dhy*(x[j+1][i]+x[j+1][i+1]-x[j-1][i]-x[j-1][i+1]),
+        e  = eta(user,ux,uy),
+        de = deta(user,ux,uy);
+      PBRATU_SHELL_SET(shell,cxn,r*(ni+1)+i-shell->is+1,hy*dhx*(e + de*ux*ux));
+      PBRATU_SHELL_SET(shell,cxt,r*(ni+1)+i-shell->is+1,0.25*hy*dhy*de*ux*uy);
+    }
+    for (i=shell->is; i<shell->ie; i++) PBRATU_SHELL_SET(shell,d,r*ni+i-shell->is,-sc*PetscExpScalar(x[j][i]));
+  }
+  for (j=shell->js-1,r=0; j<shell->je; j++,r++) {
+    for (i=shell->is; i<shell->ie; i++) {
+      const PetscScalar
+        ux = 0.25*dhx*(x[j][i+1]+x[j+1][i+1]-x[j][i-1]-x[j+1][i-1]),
+        uy = dhy*(x[j+1][i]-x[j][i]),
+        e  = eta(user,ux,uy),
+        de = deta(user,ux,uy);
+      PBRATU_SHELL_SET(shell,cyn,r*ni+i-shell->is,hx*dhy*(e + de*uy*uy));
+      PBRATU_SHELL_SET(shell,cyt,r*ni+i-shell->is,0.25*hx*dhx*de*ux*uy);
+    }
+  }
+  ierr = MatAssemblyBegin(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  ierr = PetscLogFlops(47.0*ni*(shell->je-shell->js));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(JacobianEvent,info->da,B,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatMult_JacobianShell"
+/*
+   MatMult_JacobianShell - Applies the linearized p-Bratu operator to X, from the cached coefficients
+
+   Each owned interior point combines the linearized fluxes through its four faces
+   with the Bratu term; the Dirichlet rows are the identity.  Single precision
+   coefficients are promoted, so the products and sums are in PetscScalar.
+ */
+static PetscErrorCode MatMult_JacobianShell(Mat J,Vec X,Vec Y)
+{
+  JacobianShell     *shell;
+  DMDALocalInfo     info;
+  Vec               Xloc;
+  const PetscScalar **x;
+  PetscScalar       **y;
+  PetscInt          i,j,r,ni;
+  PetscErrorCode    ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(shell->dm,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(shell->dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(shell->dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(shell->dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(shell->dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(shell->dm,Y,&y);CHKERRQ(ierr);
+  ni   = shell->ie-shell->is;
+  for (j=info.ys; j<info.ys+info.ym; j++) {
+    if (j < shell->js || j >= shell->je) {
+      for (i=info.xs; i<info.xs+info.xm; i++) y[j][i] = x[j][i];
+      continue;
+    }
+    r = j-shell->js;
+    for (i=info.xs; i<shell->is; i++)           y[j][i] = x[j][i];
+    for (i=shell->ie; i<info.xs+info.xm; i++)   y[j][i] = x[j][i];
+    if (shell->single) {
+      const PetscScalar *PETSC_RESTRICT xs  = x[j-1],*PETSC_RESTRICT xc = x[j],*PETSC_RESTRICT xn = x[j+1];
+      const float       *PETSC_RESTRICT cxn = shell->scxn+r*(ni+1)-shell->is+1,*PETSC_RESTRICT cxt = shell->scxt+r*(ni+1)-shell->is+1;
+      const float       *PETSC_RESTRICT cyn = shell->scyn+r*ni-shell->is,*PETSC_RESTRICT cyt = shell->scyt+r*ni-shell->is;
+      const float       *PETSC_RESTRICT d   = shell->sd+r*ni-shell->is;
+      PetscScalar       *PETSC_RESTRICT yc  = y[j];
+
+      PBRATU_PRAGMA_OMP_SIMD
+      for (i=shell->is; i<shell->ie; i++) {
+        const PetscScalar
+          gE = cxn[i]*(xc[i+1]-xc[i])     + cxt[i]*(xn[i]+xn[i+1]-xs[i]-xs[i+1]),
+          gW = cxn[i-1]*(xc[i]-xc[i-1])   + cxt[i-1]*(xn[i-1]+xn[i]-xs[i-1]-xs[i]),
+          gN = cyn[i+ni]*(xn[i]-xc[i])    + cyt[i+ni]*(xc[i+1]+xn[i+1]-xc[i-1]-xn[i-1]),
+          gS = cyn[i]*(xc[i]-xs[i])       + cyt[i]*(xs[i+1]+xc[i+1]-xs[i-1]-xc[i-1]);
+        yc[i] = gW - gE + gS - gN + d[i]*xc[i];
+      }
+    } else {
+      const PetscScalar *PETSC_RESTRICT xs  = x[j-1],*PETSC_RESTRICT xc = x[j],*PETSC_RESTRICT xn = x[j+1];
+      const PetscScalar *PETSC_RESTRICT cxn = shell->cxn+r*(ni+1)-shell->is+1,*PETSC_RESTRICT cxt = shell->cxt+r*(ni+1)-shell->is+1;
+      const PetscScalar *PETSC_RESTRICT cyn = shell->cyn+r*ni-shell->is,*PETSC_RESTRICT cyt = shell->cyt+r*ni-shell->is;
+      const PetscScalar *PETSC_RESTRICT d   = shell->d+r*ni-shell->is;
+      PetscScalar       *PETSC_RESTRICT yc  = y[j];
+
+      PBRATU_PRAGMA_OMP_SIMD
+      for (i=shell->is; i<shell->ie; i++) {
+        const PetscScalar
+          gE = cxn[i]*(xc[i+1]-xc[i])     + cxt[i]*(xn[i]+xn[i+1]-xs[i]-xs[i+1]),
+          gW = cxn[i-1]*(xc[i]-xc[i-1])   + cxt[i-1]*(xn[i-1]+xn[i]-xs[i-1]-xs[i]),
+          gN = cyn[i+ni]*(xn[i]-xc[i])    + cyt[i+ni]*(xc[i+1]+xn[i+1]-xc[i-1]-xn[i-1]),
+          gS = cyn[i]*(xc[i]-xs[i])       + cyt[i]*(xs[i+1]+xc[i+1]-xs[i-1]-xc[i-1]);
+        yc[i] = gW - gE + gS - gN + d[i]*xc[i];
+      }
+    }
+  }
+  ierr = DMDAVecRestoreArray(shell->dm,Y,&y);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(shell->dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(shell->dm,&Xloc);CHKERRQ(ierr);
+  ierr = PetscLogFlops(34.0*ni*(shell->je-shell->js));CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatGetDiagonal_JacobianShell"
+/*
+   MatGetDiagonal_JacobianShell - Diagonal of the matrix-free Jacobian, for Jacobi preconditioning
+ */
+static PetscErrorCode MatGetDiagonal_JacobianShell(Mat J,Vec D)
+{
+  JacobianShell  *shell;
+  DMDALocalInfo  info;
+  PetscScalar    **dd;
+  PetscInt       i,j,r,k,ni;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(shell->dm,&info);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(shell->dm,D,&dd);CHKERRQ(ierr);
+  ni   = shell->ie-shell->is;
+  for (j=info.ys; j<info.ys+info.ym; j++) {
+    for (i=info.xs; i<info.xs+info.xm; i++) {
+      if (j < shell->js || j >= shell->je || i < shell->is || i >= shell->ie) {
+        dd[j][i] = 1.0;
+      } else {
+        r = j-shell->js;
+        k = i-shell->is;
+        if (shell->single) {
+          dd[j][i] = (PetscScalar)shell->scxn[r*(ni+1)+k] + shell->scxn[r*(ni+1)+k+1] + shell->scyn[r*ni+k] + shell->scyn[(r+1)*ni+k] + shell->sd[r*ni+k];
+        } else {
+          dd[j][i] = shell->cxn[r*(ni+1)+k] + shell->cxn[r*(ni+1)+k+1] + shell->cyn[r*ni+k] + shell->cyn[(r+1)*ni+k] + shell->d[r*ni+k];
+        }
+      }
+    }
+  }
+  ierr = DMDAVecRestoreArray(shell->dm,D,&dd);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatDestroy_JacobianShell"
+static PetscErrorCode MatDestroy_JacobianShell(Mat J)
+{
+  JacobianShell  *shell;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+#if defined(PBRATU_HAVE_CUDA)
+  if (shell->cuda) {
+    ierr = PBratuCUDAFree(&shell->cxn);CHKERRQ(ierr);
+    ierr = PBratuCUDAFree(&shell->cxt);CHKERRQ(ierr);
+    ierr = PBratuCUDAFree(&shell->cyn);CHKERRQ(ierr);
+    ierr = PBratuCUDAFree(&shell->cyt);CHKERRQ(ierr);
+    ierr = PBratuCUDAFree(&shell->d);CHKERRQ(ierr);
+  } else
+#endif
+  if (shell->single) {
+    ierr = PetscFree5(shell->scxn,shell->scxt,shell->scyn,shell->scyt,shell->sd);CHKERRQ(ierr);
+  } else {
+    ierr = PetscFree5(shell->cxn,shell->cxt,shell->cyn,shell->cyt,shell->d);CHKERRQ(ierr);
+  }
+  ierr = PetscFree(shell);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#if defined(PBRATU_HAVE_CUDA)
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "CUDAGrid"
+/*
+   CUDAGrid - Sizes of the owned and ghosted blocks of the DMDA, as passed to the device kernels
+*/
+static PetscErrorCode CUDAGrid(DM dm,PBratuCUDAGrid *g)
+{
+  DMDALocalInfo  info;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr   = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  g->mx  = info.mx;  g->my  = info.my;
+  g->xs  = info.xs;  g->ys  = info.ys;  g->xm  = info.xm;  g->ym  = info.ym;
+  g->gxs = info.gxs; g->gys = info.gys; g->gxm = info.gxm; g->gym = info.gym;
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormFunctionCUDA"
+/*
+   FormFunctionCUDA - Evaluates F(x) on the GPU; x, its ghosted local form and F stay on the device
+ */
+static PetscErrorCode FormFunctionCUDA(SNES snes,Vec X,Vec F,void *ctx)
+{
+  AppCtx            *user = (AppCtx*)ctx;
+  DM                dm;
+  DMDALocalInfo     info;
+  PBratuCUDAGrid    g;
+  Vec               Xloc;
+  const PetscScalar *x;
+  PetscScalar       *f;
+  PetscErrorCode    ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = CUDAGrid(dm,&g);CHKERRQ(ierr);
+  ierr = PetscLogEventBegin(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayWrite(F,&f);CHKERRQ(ierr);
+  ierr = PBratuCUDAResidual(&g,user->lambda,user->p,user->epsilon,x,f);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayWrite(F,&f);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = PetscLogFlops(ResidualFlops(&info,user));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(ResidualEvent,dm,X,F,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "FormJacobianCUDA"
+/*
+   FormJacobianCUDA - Caches the coefficients of the matrix-free Jacobian at X on the GPU
+
+   Assembled matrices, such as the coarse-level operators of geometric multigrid,
+   are computed by FormJacobianLocal() on the host.
+ */
+static PetscErrorCode FormJacobianCUDA(SNES snes,Vec X,Mat J,Mat B,void *ctx)
+{
+  AppCtx            *user = (AppCtx*)ctx;
+  JacobianShell     *shell;
+  DM                dm;
+  DMDALocalInfo     info;
+  PBratuCUDAGrid    g;
+  Vec               Xloc;
+  const PetscScalar *x;
+  PetscBool         isshell;
+  PetscErrorCode    ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = PetscObjectTypeCompare((PetscObject)B,MATSHELL,&isshell);CHKERRQ(ierr);
+  if (!isshell) {
+    PetscScalar **xh;
+
+    ierr = DMDAVecGetArrayRead(dm,Xloc,&xh);CHKERRQ(ierr);
+    ierr = FormJacobianLocal(&info,xh,J,B,user);CHKERRQ(ierr);
+    ierr = DMDAVecRestoreArrayRead(dm,Xloc,&xh);CHKERRQ(ierr);
+    ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+  ierr = PetscLogEventBegin(JacobianEvent,dm,B,0,0);CHKERRQ(ierr);
+  ierr = MatShellGetContext(B,&shell);CHKERRQ(ierr);
+  ierr = CUDAGrid(dm,&g);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = PBratuCUDAJacobianShellCoefficients(&g,user->lambda,user->p,user->epsilon,x,shell->cxn,shell->cxt,shell->cyn,shell->cyt,shell->d);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = MatAssemblyBegin(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(B,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  if (J != B) {
+    ierr = MatAssemblyBegin(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+    ierr = MatAssemblyEnd(J,MAT_FINAL_ASSEMBLY);CHKERRQ(ierr);
+  }
+  ierr = PetscLogFlops(47.0*(shell->ie-shell->is)*(shell->je-shell->js));CHKERRQ(ierr);
+  ierr = PetscLogEventEnd(JacobianEvent,dm,B,0,0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatMult_JacobianShellCUDA"
+static PetscErrorCode MatMult_JacobianShellCUDA(Mat J,Vec X,Vec Y)
+{
+  JacobianShell     *shell;
+  PBratuCUDAGrid    g;
+  Vec               Xloc;
+  const PetscScalar *x;
+  PetscScalar       *y;
+  PetscErrorCode    ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+  ierr = CUDAGrid(shell->dm,&g);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(shell->dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(shell->dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(shell->dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayWrite(Y,&y);CHKERRQ(ierr);
+  ierr = PBratuCUDAJacobianShellMult(&g,shell->cxn,shell->cxt,shell->cyn,shell->cyt,shell->d,x,y);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayWrite(Y,&y);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayRead(Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(shell->dm,&Xloc);CHKERRQ(ierr);
+  ierr = PetscLogFlops(34.0*(shell->ie-shell->is)*(shell->je-shell->js));CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatGetDiagonal_JacobianShellCUDA"
+static PetscErrorCode MatGetDiagonal_JacobianShellCUDA(Mat J,Vec D)
+{
+  JacobianShell  *shell;
+  PBratuCUDAGrid g;
+  PetscScalar    *d;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+  ierr = CUDAGrid(shell->dm,&g);CHKERRQ(ierr);
+  ierr = VecCUDAGetArrayWrite(D,&d);CHKERRQ(ierr);
+  ierr = PBratuCUDAJacobianShellDiagonal(&g,shell->cxn,shell->cyn,shell->d,d);CHKERRQ(ierr);
+  ierr = VecCUDARestoreArrayWrite(D,&d);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "MatCreateVecs_JacobianShell"
+/*
+   MatCreateVecs_JacobianShell - Vectors of the DMDA's type, so that work vectors such as the
+   Jacobi diagonal are device vectors too
+ */
+static PetscErrorCode MatCreateVecs_JacobianShell(Mat J,Vec *right,Vec *left)
+{
+  JacobianShell  *shell;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MatShellGetContext(J,&shell);CHKERRQ(ierr);
+  if (right) {ierr = DMCreateGlobalVector(shell->dm,right);CHKERRQ(ierr);}
+  if (left)  {ierr = DMCreateGlobalVector(shell->dm,left);CHKERRQ(ierr);}
+  PetscFunctionReturn(0);
+}
+#endif
+
+#undef __FUNCT__
+#define __FUNCT__ "SetUpJacobianShell"
+/*
+   SetUpJacobianShell - With -pbratu_jacobian_type shell, gives SNES a matrix-free Jacobian on its DM
+
+   Called after every SNESSetDM(), as the matrix is sized for the grid, and whenever
+   user->jprecision changes.  The MATSHELL is both the operator and the
+   preconditioning matrix.
+ */
+static PetscErrorCode SetUpJacobianShell(SNES snes,AppCtx *user)
+{
+  JacobianShell  *shell;
+  DM             dm;
+  DMDALocalInfo  info;
+  Mat            J;
+  PetscInt       ni,nj;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (user->jtype != PBRATU_JACOBIAN_SHELL) PetscFunctionReturn(0);
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = PetscNew(&shell);CHKERRQ(ierr);
+  shell->dm = dm;
+  shell->is = PetscMax(info.xs,1);
+  shell->ie = PetscMax(PetscMin(info.xs+info.xm,info.mx-1),shell->is);
+  shell->js = PetscMax(info.ys,1);
+  shell->je = PetscMax(PetscMin(info.ys+info.ym,info.my-1),shell->js);
+  shell->cuda = user->cuda;
+  shell->single = (PetscBool)(user->jprecision == PBRATU_PRECISION_SINGLE);
+  ni        = shell->ie-shell->is;
+  nj        = shell->je-shell->js;
+  ierr = MatCreateShell(PetscObjectComm((PetscObject)dm),info.xm*info.ym,info.xm*info.ym,info.mx*info.my,info.mx*info.my,shell,&J);CHKERRQ(ierr);
+#if defined(PBRATU_HAVE_CUDA)
+  if (shell->cuda) {
+    ierr = PBratuCUDAMalloc((ni+1)*nj,&shell->cxn);CHKERRQ(ierr);
+    ierr = PBratuCUDAMalloc((ni+1)*nj,&shell->cxt);CHKERRQ(ierr);
+    ierr = PBratuCUDAMalloc(ni*(nj+1),&shell->cyn);CHKERRQ(ierr);
+    ierr = PBratuCUDAMalloc(ni*(nj+1),&shell->cyt);CHKERRQ(ierr);
+    ierr = PBratuCUDAMalloc(ni*nj,&shell->d);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(J,MATOP_MULT,(void (*)(void))MatMult_JacobianShellCUDA);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(J,MATOP_GET_DIAGONAL,(void (*)(void))MatGetDiagonal_JacobianShellCUDA);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(J,MATOP_CREATE_VECS,(void (*)(void))MatCreateVecs_JacobianShell);CHKERRQ(ierr);
+  } else
+#endif
+  {
+    if (shell->single) {
+      ierr = PetscMalloc5((ni+1)*nj,&shell->scxn,(ni+1)*nj,&shell->scxt,ni*(nj+1),&shell->scyn,ni*(nj+1),&shell->scyt,ni*nj,&shell->sd);CHKERRQ(ierr);
+    } else {
+      ierr = PetscMalloc5((ni+1)*nj,&shell->cxn,(ni+1)*nj,&shell->cxt,ni*(nj+1),&shell->cyn,ni*(nj+1),&shell->cyt,ni*nj,&shell->d);CHKERRQ(ierr);
+    }
+    ierr = MatShellSetOperation(J,MATOP_MULT,(void (*)(void))MatMult_JacobianShell);CHKERRQ(ierr);
+    ierr = MatShellSetOperation(J,MATOP_GET_DIAGONAL,(void (*)(void))MatGetDiagonal_JacobianShell);CHKERRQ(ierr);
+  }
+  ierr = MatShellSetOperation(J,MATOP_DESTROY,(void (*)(void))MatDestroy_JacobianShell);CHKERRQ(ierr);
+  ierr = SNESSetJacobian(snes,J,J,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+  ierr = MatDestroy(&J);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "LagUpdate"
+/*
+   LagUpdate - SNES update routine of the adaptive lagging policy (-pbratu_lag), run before each Newton step
+
+   The first step of every solve, and the first one after the switch from
+   Picard to Newton, rebuild the Jacobian and the preconditioner.
+   Afterwards both are reused (lag -1), unless
+     - the last linear solve took more than itsratio times the iterations of
+       the first solve with the current preconditioner: both are rebuilt;
+     - the last Newton step reduced ||F|| by less than the factor stall: only
+       the Jacobian is rebuilt, and the Krylov solve applies it with the
+       previous preconditioner.
+   A rebuild is requested with lag -2, which SNES resets to -1 once done.
+   ||F|| is read with VecNorm(), which returns the norm cached by the solver.
+ */
+static PetscErrorCode LagUpdate(SNES snes,PetscInt step)
+{
+  DM             dm;
+  AppCtx         *user;
+  LagPolicy      *lag;
+  KSP            ksp;
+  Vec            F;
+  PetscInt       lits;
+  PetscReal      fnorm;
+  PetscBool      jac = PETSC_FALSE,pc = PETSC_FALSE;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  ierr = DMGetApplicationContext(dm,&user);CHKERRQ(ierr);
+  lag  = &user->lag;
+  ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+  ierr = VecNorm(F,NORM_2,&fnorm);CHKERRQ(ierr);
+  if (!step || user->picard.switched) {
+    jac = pc = PETSC_TRUE;
+    user->picard.switched = PETSC_FALSE;
+  } else {
+    ierr = SNESGetKSP(snes,&ksp);CHKERRQ(ierr);
+    ierr = KSPGetIterationNumber(ksp,&lits);CHKERRQ(ierr);
+    if (lag->pcnew) lag->lits0 = PetscMax(lits,1);
+    if (lits > lag->itsratio*lag->lits0) {
+      jac = pc = PETSC_TRUE;
+      ierr = PetscInfo2(snes,"Rebuilding the Jacobian and preconditioner: %D linear iterations, %D with the new preconditioner\n",lits,lag->lits0);CHKERRQ(ierr);
+    } else if (fnorm > lag->stall*lag->fnorm) {
+      jac  = PETSC_TRUE;
+      ierr = PetscInfo1(snes,"Rebuilding the Jacobian: ||F|| reduced by only %g\n",(double)(fnorm/lag->fnorm));CHKERRQ(ierr);
+    }
+  }
+  lag->pcnew = pc;
+  lag->fnorm = fnorm;
+  lag->nsteps++;
+  if (jac) {
+    lag->njac++;
+    ierr = SNESSetLagJacobian(snes,-2);CHKERRQ(ierr);
+  }
+  if (pc) {
+    lag->npc++;
+    ierr = SNESSetLagPreconditioner(snes,-2);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "CoarsenHook_PBratu"
+/*
+   CoarsenHook_PBratu - Propagates RestrictHook_PBratu() to every coarsened DM
+ */
+static PetscErrorCode CoarsenHook_PBratu(DM dmfine,DM dmcoarse,void *ctx)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = DMCoarsenHookAdd(dmcoarse,CoarsenHook_PBratu,RestrictHook_PBratu,ctx);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "RestrictHook_PBratu"
+/*
+   RestrictHook_PBratu - Injects the fine-level state into the coarse level
+
+   SNES keeps the state of each coarse level in the named global vector
+   "SNESVecSol" of its DM; on the finest level the state is the SNES solution.
+   Injection keeps the pointwise values that the nonlinear coefficients eta(u)
+   and exp(u) of the coarse-level Jacobian are evaluated at.
+ */
+static PetscErrorCode RestrictHook_PBratu(DM dmfine,Mat mrestrict,Vec rscale,Mat inject,DM dmcoarse,void *ctx)
+{
+  SNES           snes = (SNES)ctx;
+  DM             dm;
+  Vec            Xfine,Xcoarse;
+  Mat            Inject = inject;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  if (dmfine == dm) {
+    ierr = SNESGetSolution(snes,&Xfine);CHKERRQ(ierr);
+  } else {
+    ierr = DMGetNamedGlobalVector(dmfine,"SNESVecSol",&Xfine);CHKERRQ(ierr);
+  }
+  ierr = DMGetNamedGlobalVector(dmcoarse,"SNESVecSol",&Xcoarse);CHKERRQ(ierr);
+  if (!Inject) {
+    ierr = DMCreateInjection(dmcoarse,dmfine,&Inject);CHKERRQ(ierr);
+  }
+  ierr = MatRestrict(Inject,Xfine,Xcoarse);CHKERRQ(ierr);
+  if (!inject) {
+    ierr = MatDestroy(&Inject);CHKERRQ(ierr);
+  }
+  ierr = DMRestoreNamedGlobalVector(dmcoarse,"SNESVecSol",&Xcoarse);CHKERRQ(ierr);
+  if (dmfine != dm) {
+    ierr = DMRestoreNamedGlobalVector(dmfine,"SNESVecSol",&Xfine);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "SetUpMultigridRestriction"
+/*
+   SetUpMultigridRestriction - Installs the transfer of the state to coarse levels selected by -pbratu_mg_restrict
+
+   With multigrid, SNES restricts the current solution to the coarse levels,
+   where FormJacobianLocal() rediscretizes the operator.  For injection, our
+   hook is added after SNESSetUp() has installed the SNES one, so it runs last
+   and overwrites the restricted state.  Must be called again whenever the
+   SNES is given a new DM.
+ */
+static PetscErrorCode SetUpMultigridRestriction(SNES snes,AppCtx *user)
+{
+  DM             dm;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (user->mgrestrict == PBRATU_RESTRICT_INJECT) {
+    ierr = SNESSetUp(snes);CHKERRQ(ierr);
+    ierr = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+    ierr = DMCoarsenHookAdd(dm,CoarsenHook_PBratu,RestrictHook_PBratu,snes);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "SolveGridSequence"
+/*
+   SolveGridSequence - Solves on the grid of *dm, then nseq times refines the grid, interpolates
+   the solution and solves again (nested iteration)
+
+   Input Parameters:
+   snes - nonlinear solver, set up on *dm
+   nseq - number of refinements
+   dm   - coarsest grid
+   X    - initial guess on the coarsest grid
+
+   Output Parameters:
+   dm - finest grid
+   X  - solution on the finest grid
+
+   With nseq > 0 the grid size, SNES iteration count and solve time of each level are printed.
+ */
+static PetscErrorCode SolveGridSequence(SNES snes,PetscInt nseq,DM *dm,Vec *X,AppCtx *user)
+{
+  PetscInt            level,its,dim,mx,my,mz;
+  PetscLogDouble      t0,t1;
+  SNESConvergedReason reason;
+  DM                  dmf;
+  Mat                 interp;
+  Vec                 Xf;
+  PetscErrorCode      ierr;
+
+  PetscFunctionBegin;
+  for (level=0; ; level++) {
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = SNESSolve(snes,PETSC_NULL,*X);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    if (nseq) {
+      ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+      ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+      ierr = DMDAGetInfo(*dm,&dim,&mx,&my,&mz,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
+                         PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);CHKERRQ(ierr);
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Grid sequence level %D: %D x %D",level,mx,my);CHKERRQ(ierr);
+      if (dim == 3) {ierr = PetscPrintf(PETSC_COMM_WORLD," x %D",mz);CHKERRQ(ierr);}
+      ierr = PetscPrintf(PETSC_COMM_WORLD," grid, %s, %D Newton iterations, %g s\n",SNESConvergedReasons[reason],its,t1-t0);CHKERRQ(ierr);
+    }
+    if (level == nseq) break;
+
+    /*
+       Interpolate the solution to the refined grid; the refined DMDA inherits
+       the residual and Jacobian callbacks and the application context
+    */
+    ierr = DMRefine(*dm,PetscObjectComm((PetscObject)*dm),&dmf);CHKERRQ(ierr);
+    ierr = DMCreateInterpolation(*dm,dmf,&interp,PETSC_NULL);CHKERRQ(ierr);
+    ierr = DMCreateGlobalVector(dmf,&Xf);CHKERRQ(ierr);
+    ierr = MatInterpolate(interp,*X,Xf);CHKERRQ(ierr);
+    ierr = DMInterpolate(*dm,interp,dmf);CHKERRQ(ierr);
+    ierr = MatDestroy(&interp);CHKERRQ(ierr);
+    ierr = VecDestroy(X);CHKERRQ(ierr);
+    ierr = DMDestroy(dm);CHKERRQ(ierr);
+    *X   = Xf;
+    *dm  = dmf;
+
+    ierr = SNESReset(snes);CHKERRQ(ierr);
+    ierr = SNESSetDM(snes,*dm);CHKERRQ(ierr);
+    ierr = SetUpMultigridRestriction(snes,user);CHKERRQ(ierr);
+    ierr = SetUpJacobianShell(snes,user);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "SolveContinuation"
+/*
+   SolveContinuation - Solves for each (p,lambda) of the continuation schedule
+
+   The first step is solved with SolveGridSequence(); the remaining steps reuse
+   the finest DM, the vectors and the SNES, starting from the previous solution.
+   With -pbratu_continuation_secant, the initial guess is instead extrapolated
+   along the secant through the last two solutions, scaled by the ratio of the
+   parameter step lengths.  With more than one step, the time for each step and
+   the total are printed.  The continuation stops at the first step that fails
+   to converge.  The steps before cont->start are skipped, and with a
+   checkpoint file each converged step is saved with WriteCheckpoint().
+ */
+static PetscErrorCode SolveContinuation(SNES snes,PetscInt nseq,DM *dm,Vec *X,AppCtx *user,Continuation *cont)
+{
+  PetscInt            k,its;
+  PetscReal           ds = 0,dsprev = 0;
+  PetscLogDouble      t0,t1,tstart;
+  SNESConvergedReason reason;
+  Vec                 Xprev = PETSC_NULL;
+  PetscErrorCode      ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscTime(&tstart);CHKERRQ(ierr);
+  for (k=cont->start; k<cont->n; k++) {
+    user->p      = cont->p[PetscMin(k,cont->np-1)];
+    user->lambda = cont->lambda[PetscMin(k,cont->nlambda-1)];
+    if (k > cont->start) {
+      dsprev = ds;
+      ds     = PetscSqrtReal(PetscSqr(user->p - cont->p[PetscMin(k-1,cont->np-1)]) + PetscSqr(user->lambda - cont->lambda[PetscMin(k-1,cont->nlambda-1)]));
+    }
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    if (k == cont->start) {
+      ierr = SolveGridSequence(snes,nseq,dm,X,user);CHKERRQ(ierr);
+    } else {
+      if (cont->secant) {
+        if (!Xprev) {
+          ierr = VecDuplicate(*X,&Xprev);CHKERRQ(ierr);
+          ierr = VecCopy(*X,Xprev);CHKERRQ(ierr);
+        } else {
+          /* Xprev <- X + r (X - Xprev), then swap so that X is the prediction and Xprev the last solution */
+          const PetscReal r = dsprev > 0 ? ds/dsprev : 0;
+
+          ierr = VecAXPBY(Xprev,1+r,-r,*X);CHKERRQ(ierr);
+          ierr = VecSwap(*X,Xprev);CHKERRQ(ierr);
+        }
+      }
+      ierr = SNESSolve(snes,PETSC_NULL,*X);CHKERRQ(ierr);
+    }
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+    if (cont->n > 1) {
+      ierr = PetscPrintf(PETSC_COMM_WORLD,"Continuation step %D: p = %g, lambda = %g, %s, %D Newton iterations, %g s\n",
+                         k,(double)user->p,(double)user->lambda,SNESConvergedReasons[reason],its,t1-t0);CHKERRQ(ierr);
+    }
+    if (reason > 0 && cont->checkpoint[0]) {
+      ierr = WriteCheckpoint(cont->checkpoint,*X,user,k,its);CHKERRQ(ierr);
+    }
+    if (reason < 0) {
+      if (k < cont->n-1) {
+        ierr = PetscPrintf(PETSC_COMM_WORLD,"Continuation stopped after step %D\n",k);CHKERRQ(ierr);
+      }
+      break;
+    }
+  }
+  if (cont->n > 1) {
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"Continuation total time %g s\n",t1-tstart);CHKERRQ(ierr);
+  }
+  ierr = VecDestroy(&Xprev);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+/*
+   Checkpoints store the solution as the vector (HDF5 dataset) "solution", in the
+   natural ordering of the DMDA, so that they can be read on any number of ranks.
+   The header is a CheckpointHeader: in HDF5 as attributes of the dataset, in
+   binary files as an integer and a real block preceding the vector.
+*/
+#define PBRATU_CHECKPOINT_ID 1211299
+#define PBRATU_CHECKPOINT_NI 7
+#define PBRATU_CHECKPOINT_NR 2
+
+#undef __FUNCT__
+#define __FUNCT__ "CheckpointIsHDF5"
+/*
+   CheckpointIsHDF5 - Whether the checkpoint file is HDF5 (its name ends in .h5) rather than PETSc binary
+ */
+static PetscErrorCode CheckpointIsHDF5(const char file[],PetscBool *hdf5)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscStrendswith(file,".h5",hdf5);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "OpenCheckpoint"
+/*
+   OpenCheckpoint - Opens the checkpoint file path, in HDF5 or PETSc binary format
+
+   The format hdf5 is that of the checkpoint name (see CheckpointIsHDF5()), not
+   of path, which for a temporary file differs from it.  The binary viewer
+   takes its options (e.g. -viewer_binary_mpiio) from the options database,
+   and writes no .info file.
+ */
+static PetscErrorCode OpenCheckpoint(MPI_Comm comm,const char path[],PetscBool hdf5,PetscFileMode mode,PetscViewer *viewer)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (hdf5) {
+#if defined(PETSC_HAVE_HDF5)
+    ierr = PetscViewerHDF5Open(comm,path,mode,viewer);CHKERRQ(ierr);
+#else
+    SETERRQ1(comm,PETSC_ERR_SUP,"Checkpoint %s requires PETSc configured with HDF5",path);
+#endif
+  } else {
+    ierr = PetscViewerCreate(comm,viewer);CHKERRQ(ierr);
+    ierr = PetscViewerSetType(*viewer,PETSCVIEWERBINARY);CHKERRQ(ierr);
+    ierr = PetscViewerBinarySetSkipInfo(*viewer,PETSC_TRUE);CHKERRQ(ierr);
+    ierr = PetscViewerSetFromOptions(*viewer);CHKERRQ(ierr);
+    ierr = PetscViewerFileSetMode(*viewer,mode);CHKERRQ(ierr);
+    ierr = PetscViewerFileSetName(*viewer,path);CHKERRQ(ierr);
+  }
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "WriteCheckpoint"
+/*
+   WriteCheckpoint - Saves the solution X of continuation step `step', which took its Newton iterations
+
+   The file is written as <file>.tmp, in the format of file, and then renamed,
+   so that a job stopped while writing leaves the previous checkpoint intact.
+ */
+static PetscErrorCode WriteCheckpoint(const char file[],Vec X,const AppCtx *user,PetscInt step,PetscInt its)
+{
+  MPI_Comm       comm;
+  char           tmp[PETSC_MAX_PATH_LEN];
+  DM             dm;
+  PetscViewer    viewer;
+  PetscBool      hdf5;
+  PetscInt       ihdr[PBRATU_CHECKPOINT_NI];
+  PetscReal      rhdr[PBRATU_CHECKPOINT_NR];
+  PetscMPIInt    rank;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr    = PetscObjectGetComm((PetscObject)X,&comm);CHKERRQ(ierr);
+  ierr    = VecGetDM(X,&dm);CHKERRQ(ierr);
+  ierr    = DMDAGetInfo(dm,&ihdr[1],&ihdr[2],&ihdr[3],&ihdr[4],PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
+                        PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);CHKERRQ(ierr);
+  ihdr[0] = PBRATU_CHECKPOINT_ID;
+  ihdr[5] = step;
+  ihdr[6] = its;
+  rhdr[0] = user->p;
+  rhdr[1] = user->lambda;
+  ierr    = PetscSNPrintf(tmp,sizeof(tmp),"%s.tmp",file);CHKERRQ(ierr);
+  ierr    = PetscObjectSetName((PetscObject)X,"solution");CHKERRQ(ierr);
+  ierr    = CheckpointIsHDF5(file,&hdf5);CHKERRQ(ierr);
+  ierr    = OpenCheckpoint(comm,tmp,hdf5,FILE_MODE_WRITE,&viewer);CHKERRQ(ierr);
+  if (hdf5) {
+#if defined(PETSC_HAVE_HDF5)
+    const char *const names[PBRATU_CHECKPOINT_NI+PBRATU_CHECKPOINT_NR] = {"id","dim","mx","my","mz","step","its","p","lambda"};
+    PetscInt          k;
+
+    ierr = VecView(X,viewer);CHKERRQ(ierr);
+    for (k=0; k<PBRATU_CHECKPOINT_NI; k++) {
+      ierr = PetscViewerHDF5WriteAttribute(viewer,"/solution",names[k],PETSC_INT,&ihdr[k]);CHKERRQ(ierr);
+    }
+    for (k=0; k<PBRATU_CHECKPOINT_NR; k++) {
+      ierr = PetscViewerHDF5WriteAttribute(viewer,"/solution",names[PBRATU_CHECKPOINT_NI+k],PETSC_REAL,&rhdr[k]);CHKERRQ(ierr);
+    }
+#endif
+  } else {
+    ierr = PetscViewerBinaryWrite(viewer,ihdr,PBRATU_CHECKPOINT_NI,PETSC_INT,PETSC_FALSE);CHKERRQ(ierr);
+    ierr = PetscViewerBinaryWrite(viewer,rhdr,PBRATU_CHECKPOINT_NR,PETSC_REAL,PETSC_FALSE);CHKERRQ(ierr);
+    ierr = VecView(X,viewer);CHKERRQ(ierr);
+  }
+  ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(comm,&rank);CHKERRQ(ierr);
+  if (!rank && rename(tmp,file)) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_FILE_WRITE,"Cannot rename checkpoint %s to %s",tmp,file);
+  ierr = MPI_Barrier(comm);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "ReadCheckpoint"
+/*
+   ReadCheckpoint - Reads the header of a checkpoint and, unless X is NULL, loads its solution into X
+
+   X must be a vector of a DMDA with the grid of the checkpoint.
+ */
+static PetscErrorCode ReadCheckpoint(const char file[],Vec X,CheckpointHeader *hdr)
+{
+  MPI_Comm       comm = X ? PetscObjectComm((PetscObject)X) : PETSC_COMM_WORLD;
+  PetscViewer    viewer;
+  PetscBool      hdf5;
+  PetscInt       ihdr[PBRATU_CHECKPOINT_NI];
+  PetscReal      rhdr[PBRATU_CHECKPOINT_NR];
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = CheckpointIsHDF5(file,&hdf5);CHKERRQ(ierr);
+  ierr = OpenCheckpoint(comm,file,hdf5,FILE_MODE_READ,&viewer);CHKERRQ(ierr);
+  if (hdf5) {
+#if defined(PETSC_HAVE_HDF5)
+    const char *const names[PBRATU_CHECKPOINT_NI+PBRATU_CHECKPOINT_NR] = {"id","dim","mx","my","mz","step","its","p","lambda"};
+    PetscInt          k;
+
+    for (k=0; k<PBRATU_CHECKPOINT_NI; k++) {
+      ierr = PetscViewerHDF5ReadAttribute(viewer,"/solution",names[k],PETSC_INT,&ihdr[k]);CHKERRQ(ierr);
+    }
+    for (k=0; k<PBRATU_CHECKPOINT_NR; k++) {
+      ierr = PetscViewerHDF5ReadAttribute(viewer,"/solution",names[PBRATU_CHECKPOINT_NI+k],PETSC_REAL,&rhdr[k]);CHKERRQ(ierr);
+    }
+#endif
+  } else {
+    ierr = PetscViewerBinaryRead(viewer,ihdr,PBRATU_CHECKPOINT_NI,PETSC_NULL,PETSC_INT);CHKERRQ(ierr);
+    ierr = PetscViewerBinaryRead(viewer,rhdr,PBRATU_CHECKPOINT_NR,PETSC_NULL,PETSC_REAL);CHKERRQ(ierr);
+  }
+  if (ihdr[0] != PBRATU_CHECKPOINT_ID) SETERRQ1(comm,PETSC_ERR_FILE_UNEXPECTED,"%s is not a pbratu checkpoint",file);
+  hdr->dim    = ihdr[1];
+  hdr->mx     = ihdr[2];
+  hdr->my     = ihdr[3];
+  hdr->mz     = ihdr[4];
+  hdr->step   = ihdr[5];
+  hdr->its    = ihdr[6];
+  hdr->p      = rhdr[0];
+  hdr->lambda = rhdr[1];
+  if (X) {
+    ierr = PetscObjectSetName((PetscObject)X,"solution");CHKERRQ(ierr);
+    ierr = VecLoad(X,viewer);CHKERRQ(ierr);
+  }
+  ierr = PetscViewerDestroy(&viewer);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+/*
+   Asynchronous solution output (-pbratu_output), see AsyncOutput
+*/
+
+/*
+   AsyncOutputWrite - Writes the staged snapshot; returns 0 or an errno
+
+   Runs on the writer thread, so it only uses the C library.
+*/
+static int AsyncOutputWrite(AsyncOutput *out)
+{
+  const size_t n = (size_t)out->ihdr[8]*out->ihdr[9]*out->ihdr[10];
+  char         file[PETSC_MAX_PATH_LEN];
+  FILE         *fp;
+  int          err = 0;
+
+  snprintf(file,sizeof(file),"%s.%d.%d",out->prefix,(int)out->ihdr[1],(int)out->rank);
+  if (!(fp = fopen(file,"wb"))) return errno ? errno : EIO;
+  if (fwrite(out->ihdr,sizeof(PetscInt),PBRATU_OUTPUT_NI,fp) != PBRATU_OUTPUT_NI
+      || fwrite(out->rhdr,sizeof(PetscReal),2,fp) != 2
+      || fwrite(out->buf,sizeof(PetscScalar),n,fp) != n) err = errno ? errno : EIO;
+  if (fclose(fp) && !err) err = errno ? errno : EIO;
+  return err;
+}
+
+#if defined(PETSC_HAVE_PTHREAD)
+static void *AsyncOutputThread(void *arg)
+{
+  AsyncOutput *out = (AsyncOutput*)arg;
+  int         err;
+
+  pthread_mutex_lock(&out->lock);
+  for (;;) {
+    while (!out->busy && !out->quit) pthread_cond_wait(&out->cond,&out->lock);
+    if (!out->busy) break;
+    pthread_mutex_unlock(&out->lock);
+    err = AsyncOutputWrite(out);
+    pthread_mutex_lock(&out->lock);
+    if (err) out->failed = err;
+    out->busy = 0;
+    pthread_cond_broadcast(&out->cond);
+  }
+  pthread_mutex_unlock(&out->lock);
+  return NULL;
+}
+#endif
+
+/*
+   DecimatedRange - The multiples of stride in s <= i < e are stride*i0, ..., stride*(i0+n-1)
+*/
+PETSC_STATIC_INLINE void DecimatedRange(PetscInt s,PetscInt e,PetscInt stride,PetscInt *i0,PetscInt *n)
+{
+  *i0 = (s+stride-1)/stride;
+  *n  = PetscMax((e+stride-1)/stride - *i0,0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "AsyncOutputMonitor"
+/*
+   AsyncOutputMonitor - SNES monitor that stages a decimated copy of the solution for the writer
+ */
+static PetscErrorCode AsyncOutputMonitor(SNES snes,PetscInt its,PetscReal fnorm,void *ctx)
+{
+  AsyncOutput       *out = (AsyncOutput*)ctx;
+  PetscLogDouble    t0,t1;
+  DM                dm;
+  Vec               X;
+  const PetscScalar *x;
+  PetscInt          dim,mx,my,mz,xs,ys,zs,xm,ym,zm,i0,j0,k0,ni,nj,nk,i,j,k,n,s = out->stride;
+  int               flags[2],gflags[2];
+  PetscErrorCode    ierr;
+
+  PetscFunctionBegin;
+  if (its % out->interval) PetscFunctionReturn(0);
+  ierr = PetscTime(&t0);CHKERRQ(ierr);
+#if defined(PETSC_HAVE_PTHREAD)
+  pthread_mutex_lock(&out->lock);
+  flags[0] = out->busy;
+  flags[1] = out->failed;
+  pthread_mutex_unlock(&out->lock);
+#else
+  flags[0] = 0;
+  flags[1] = out->failed;
+#endif
+  /* all ranks take the same decision, so that no snapshot is incomplete */
+  ierr = MPI_Allreduce(flags,gflags,2,MPI_INT,MPI_MAX,out->comm);CHKERRQ(ierr);
+  if (gflags[1]) SETERRQ2(out->comm,PETSC_ERR_FILE_WRITE,"Writing the output %s.* failed: %s",out->prefix,strerror(gflags[1]));
+  if (gflags[0]) {
+    out->nskipped++;
+  } else {
+    ierr = SNESGetSolution(snes,&X);CHKERRQ(ierr);
+    ierr = VecGetDM(X,&dm);CHKERRQ(ierr);
+    ierr = DMDAGetInfo(dm,&dim,&mx,&my,&mz,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
+                       PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);CHKERRQ(ierr);
+    ierr = DMDAGetCorners(dm,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+    DecimatedRange(xs,xs+xm,s,&i0,&ni);
+    DecimatedRange(ys,ys+ym,s,&j0,&nj);
+    if (dim == 3) {
+      DecimatedRange(zs,zs+zm,s,&k0,&nk);
+    } else {
+      k0 = 0; nk = 1; mz = 1; /* DMDAGetCorners() gives zm = 1 in 2D */
+    }
+    if (ni*nj*nk > out->capacity) {
+      ierr = PetscFree(out->buf);CHKERRQ(ierr);
+      ierr = PetscMalloc1(ni*nj*nk,&out->buf);CHKERRQ(ierr);
+      out->capacity = ni*nj*nk;
+    }
+    ierr = VecGetArrayRead(X,&x);CHKERRQ(ierr);
+    for (k=0,n=0; k<nk; k++) {
+      for (j=0; j<nj; j++) {
+        const PetscScalar *xr = x + ((dim == 3 ? s*(k0+k)-zs : 0)*ym + s*(j0+j)-ys)*xm - xs;
+
+        for (i=0; i<ni; i++) out->buf[n++] = xr[s*(i0+i)];
+      }
+    }
+    ierr = VecRestoreArrayRead(X,&x);CHKERRQ(ierr);
+    out->ihdr[0]  = its;
+    out->ihdr[1]  = out->nsnap++;
+    out->ihdr[2]  = (mx+s-1)/s;
+    out->ihdr[3]  = (my+s-1)/s;
+    out->ihdr[4]  = (mz+s-1)/s;
+    out->ihdr[5]  = i0;
+    out->ihdr[6]  = j0;
+    out->ihdr[7]  = k0;
+    out->ihdr[8]  = ni;
+    out->ihdr[9]  = nj;
+    out->ihdr[10] = nk;
+    out->rhdr[0]  = out->user->p;
+    out->rhdr[1]  = out->user->lambda;
+#if defined(PETSC_HAVE_PTHREAD)
+    pthread_mutex_lock(&out->lock);
+    out->busy = 1;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+#else
+    out->failed = AsyncOutputWrite(out);
+#endif
+  }
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  out->tmonitor += t1-t0;
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "AsyncOutputCreate"
+/*
+   AsyncOutputCreate - Starts the writer thread and adds AsyncOutputMonitor() to snes
+ */
+static PetscErrorCode AsyncOutputCreate(SNES snes,const AppCtx *user,AsyncOutput *out)
+{
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (out->interval < 1 || out->stride < 1) SETERRQ(PetscObjectComm((PetscObject)snes),PETSC_ERR_ARG_OUTOFRANGE,"The output interval and stride must be positive");
+  out->user     = user;
+  out->buf      = PETSC_NULL;
+  out->capacity = 0;
+  out->nsnap    = 0;
+  out->nskipped = 0;
+  out->tmonitor = 0;
+  out->failed   = 0;
+  ierr = PetscObjectGetComm((PetscObject)snes,&out->comm);CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(out->comm,&out->rank);CHKERRQ(ierr);
+#if defined(PETSC_HAVE_PTHREAD)
+  out->busy = 0;
+  out->quit = 0;
+  pthread_mutex_init(&out->lock,NULL);
+  pthread_cond_init(&out->cond,NULL);
+  if (pthread_create(&out->thread,NULL,AsyncOutputThread,out)) SETERRQ(PETSC_COMM_SELF,PETSC_ERR_LIB,"Cannot create the output thread");
+#endif
+  ierr = SNESMonitorSet(snes,AsyncOutputMonitor,out,PETSC_NULL);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "AsyncOutputDestroy"
+/*
+   AsyncOutputDestroy - Waits for the last snapshot, stops the writer and reports the output
+ */
+static PetscErrorCode AsyncOutputDestroy(AsyncOutput *out)
+{
+  PetscLogDouble t;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+#if defined(PETSC_HAVE_PTHREAD)
+  pthread_mutex_lock(&out->lock);
+  out->quit = 1;
+  pthread_cond_signal(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+  pthread_join(out->thread,NULL);
+  pthread_cond_destroy(&out->cond);
+  pthread_mutex_destroy(&out->lock);
+#endif
+  ierr = PetscFree(out->buf);CHKERRQ(ierr);
+  ierr = MPI_Allreduce(&out->tmonitor,&t,1,MPI_DOUBLE,MPI_MAX,out->comm);CHKERRQ(ierr);
+  ierr = PetscPrintf(out->comm,"Output: %D snapshots written to %s.*, %D skipped, %g s in the monitor\n",out->nsnap,out->prefix,out->nskipped,t);CHKERRQ(ierr);
+  if (out->failed) SETERRQ2(PETSC_COMM_SELF,PETSC_ERR_FILE_WRITE,"Writing the output %s.* failed: %s",out->prefix,strerror(out->failed));
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "TelemetryMonitor"
+/*
+   TelemetryMonitor - SNES monitor that adds the record of Newton iteration its to the telemetry buffer
+
+   Only reads local counters: no communication and no output.
+ */
+static PetscErrorCode TelemetryMonitor(SNES snes,PetscInt its,PetscReal fnorm,void *ctx)
+{
+  Telemetry          *tel = (Telemetry*)ctx;
+  TelemetryRecord    *r;
+  PetscEventPerfInfo info;
+  PetscLogDouble     t,e[PBRATU_TELEMETRY_NE];
+  PetscInt           lits,k;
+  PetscErrorCode     ierr;
+
+  PetscFunctionBegin;
+  if (!its) {
+    tel->nsolve++;
+    tel->lits = 0;
+  }
+  ierr = PetscTime(&t);CHKERRQ(ierr);
+  for (k=0; k<PBRATU_TELEMETRY_NE; k++) {
+    ierr = PetscLogEventGetPerfInfo(tel->stage,tel->event[k],&info);CHKERRQ(ierr);
+    e[k] = info.time;
+  }
+  ierr = SNESGetLinearSolveIterations(snes,&lits);CHKERRQ(ierr);
+  if (tel->n < tel->capacity) {
+    r         = &tel->rec[tel->n++];
+    r->solve  = tel->nsolve-1;
+    r->its    = its;
+    r->lits   = lits - tel->lits;
+    r->p      = tel->user->p;
+    r->lambda = tel->user->lambda;
+    r->fnorm  = fnorm;
+    r->v[0]   = t - tel->t0;
+    for (k=0; k<PBRATU_TELEMETRY_NE; k++) r->v[k+1] = e[k] - tel->last[k];
+    r->v[4]  -= r->v[3]; /* PCSetUp() runs inside KSPSolve() */
+    ierr = PetscMemoryGetMaximumUsage(&r->v[5]);CHKERRQ(ierr);
+  } else {
+    tel->ndropped++;
+  }
+  for (k=0; k<PBRATU_TELEMETRY_NE; k++) tel->last[k] = e[k];
+  tel->lits = lits;
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "TelemetryCreate"
+/*
+   TelemetryCreate - Allocates the telemetry buffer and adds TelemetryMonitor() to snes, whose solves run in stage
+ */
+static PetscErrorCode TelemetryCreate(SNES snes,const AppCtx *user,PetscLogStage stage,Telemetry *tel)
+{
+  const char     *names[PBRATU_TELEMETRY_NE] = {"SNESFunctionEval","SNESJacobianEval","PCSetUp","KSPSolve"};
+  PetscInt       k;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  if (tel->capacity < 1) SETERRQ(PetscObjectComm((PetscObject)snes),PETSC_ERR_ARG_OUTOFRANGE,"The telemetry buffer size must be positive");
+  tel->user     = user;
+  tel->stage    = stage;
+  tel->n        = 0;
+  tel->nsolve   = 0;
+  tel->ndropped = 0;
+  tel->lits     = 0;
+  ierr = PetscObjectGetComm((PetscObject)snes,&tel->comm);CHKERRQ(ierr);
+  for (k=0; k<PBRATU_TELEMETRY_NE; k++) {
+    ierr = PetscLogEventGetId(names[k],&tel->event[k]);CHKERRQ(ierr);
+    tel->last[k] = 0;
+  }
+  ierr = PetscMalloc1(tel->capacity,&tel->rec);CHKERRQ(ierr);
+  ierr = PetscMemzero(tel->rec,tel->capacity*sizeof(TelemetryRecord));CHKERRQ(ierr); /* touch the pages before the solve */
+  ierr = PetscTime(&tel->t0);CHKERRQ(ierr);
+  ierr = SNESMonitorSet(snes,TelemetryMonitor,tel,PETSC_NULL);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "TelemetryDestroy"
+/*
+   TelemetryDestroy - Reduces the records over the ranks, writes them to the telemetry file and frees the buffer
+
+   Every rank holds the same records, since the monitor runs on all of them at each
+   iteration; only their times and memory peaks differ.
+ */
+static PetscErrorCode TelemetryDestroy(Telemetry *tel)
+{
+  const char      *fields[PBRATU_TELEMETRY_NV] = {"time","residual","jacobian","pcsetup","ksp","memory"};
+  FILE            *fp;
+  PetscLogDouble  *v,*vmax;
+  PetscMPIInt     size,nv;
+  PetscBool       csv;
+  PetscInt        i,k;
+  TelemetryRecord *r;
+  PetscErrorCode  ierr;
+
+  PetscFunctionBegin;
+  ierr = MPI_Comm_size(tel->comm,&size);CHKERRQ(ierr);
+  ierr = PetscMPIIntCast(tel->n*PBRATU_TELEMETRY_NV,&nv);CHKERRQ(ierr);
+  ierr = PetscMalloc2(tel->n*PBRATU_TELEMETRY_NV,&v,tel->n*PBRATU_TELEMETRY_NV,&vmax);CHKERRQ(ierr);
+  for (i=0; i<tel->n; i++) {
+    for (k=0; k<PBRATU_TELEMETRY_NV; k++) v[i*PBRATU_TELEMETRY_NV+k] = tel->rec[i].v[k];
+  }
+  ierr = MPI_Reduce(v,vmax,nv,MPI_DOUBLE,MPI_MAX,0,tel->comm);CHKERRQ(ierr);
+
+  ierr = PetscStrendswith(tel->file,".csv",&csv);CHKERRQ(ierr);
+  ierr = PetscFOpen(tel->comm,tel->file,"w",&fp);CHKERRQ(ierr);
+  if (csv) {
+    ierr = PetscFPrintf(tel->comm,fp,"solve,its,p,lambda,fnorm,lits");CHKERRQ(ierr);
+    for (k=0; k<PBRATU_TELEMETRY_NV; k++) {ierr = PetscFPrintf(tel->comm,fp,",%s",fields[k]);CHKERRQ(ierr);}
+    ierr = PetscFPrintf(tel->comm,fp,"\n");CHKERRQ(ierr);
+  } else {
+    ierr = PetscFPrintf(tel->comm,fp,"{\"ranks\": %d, \"capacity\": %D, \"dropped\": %D, \"records\": [",(int)size,tel->capacity,tel->ndropped);CHKERRQ(ierr);
+  }
+  for (i=0; i<tel->n; i++) {
+    r = &tel->rec[i];
+    if (csv) {
+      ierr = PetscFPrintf(tel->comm,fp,"%D,%D,%.17g,%.17g,%.17g,%D",r->solve,r->its,(double)r->p,(double)r->lambda,(double)r->fnorm,r->lits);CHKERRQ(ierr);
+      for (k=0; k<PBRATU_TELEMETRY_NV; k++) {ierr = PetscFPrintf(tel->comm,fp,",%.9g",vmax[i*PBRATU_TELEMETRY_NV+k]);CHKERRQ(ierr);}
+      ierr = PetscFPrintf(tel->comm,fp,"\n");CHKERRQ(ierr);
+    } else {
+      ierr = PetscFPrintf(tel->comm,fp,"%s\n  {\"solve\": %D, \"its\": %D, \"p\": %.17g, \"lambda\": %.17g, \"fnorm\": %.17g, \"lits\": %D",
+                          i ? "," : "",r->solve,r->its,(double)r->p,(double)r->lambda,(double)r->fnorm,r->lits);CHKERRQ(ierr);
+      for (k=0; k<PBRATU_TELEMETRY_NV; k++) {ierr = PetscFPrintf(tel->comm,fp,", \"%s\": %.9g",fields[k],vmax[i*PBRATU_TELEMETRY_NV+k]);CHKERRQ(ierr);}
+      ierr = PetscFPrintf(tel->comm,fp,"}");CHKERRQ(ierr);
+    }
+  }
+  if (!csv) {ierr = PetscFPrintf(tel->comm,fp,"\n]}\n");CHKERRQ(ierr);}
+  ierr = PetscFClose(tel->comm,fp);CHKERRQ(ierr);
+  ierr = PetscPrintf(tel->comm,"Telemetry: %D records of %D solves written to %s, %D dropped\n",tel->n,tel->nsolve,tel->file,tel->ndropped);CHKERRQ(ierr);
+  ierr = PetscFree2(v,vmax);CHKERRQ(ierr);
+  ierr = PetscFree(tel->rec);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "ReadEnsemble"
+/*
+   ReadEnsemble - Reads the (p,lambda) of the ensemble instances from file, one pair per line
+
+   Blank lines and lines starting with # are skipped.  On return *p and *lambda
+   are arrays of *n entries, to be freed with PetscFree2().
+ */
+static PetscErrorCode ReadEnsemble(MPI_Comm comm,const char file[],PetscInt *n,PetscReal **p,PetscReal **lambda)
+{
+  FILE           *fp;
+  char           line[PETSC_MAX_PATH_LEN],*s;
+  double         pi,li;
+  PetscInt       nalloc = 0,nline = 0;
+  PetscReal      *pp,*ll;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  *n      = 0;
+  *p      = PETSC_NULL;
+  *lambda = PETSC_NULL;
+  ierr = PetscFOpen(comm,file,"r",&fp);CHKERRQ(ierr);
+  for (;;) {
+    ierr = PetscSynchronizedFGets(comm,fp,sizeof(line),line);CHKERRQ(ierr);
+    if (!line[0]) break;
+    nline++;
+    for (s=line; *s == ' ' || *s == '\t'; s++) ;
+    if (*s == '#' || *s == '\n' || *s == '\r' || !*s) continue;
+    if (sscanf(s,"%lf %lf",&pi,&li) != 2) SETERRQ2(comm,PETSC_ERR_FILE_UNEXPECTED,"Line %D of %s is not `p lambda'",nline,file);
+    if (pi < 1 || li < 0) SETERRQ2(comm,PETSC_ERR_ARG_OUTOFRANGE,"Line %D of %s: p must be at least 1 and lambda nonnegative",nline,file);
+    if (*n == nalloc) {
+      nalloc = PetscMax(2*nalloc,64);
+      ierr   = PetscMalloc2(nalloc,&pp,nalloc,&ll);CHKERRQ(ierr);
+      ierr   = PetscMemcpy(pp,*p,*n*sizeof(PetscReal));CHKERRQ(ierr);
+      ierr   = PetscMemcpy(ll,*lambda,*n*sizeof(PetscReal));CHKERRQ(ierr);
+      ierr   = PetscFree2(*p,*lambda);CHKERRQ(ierr);
+      *p      = pp;
+      *lambda = ll;
+    }
+    (*p)[*n]      = pi;
+    (*lambda)[*n] = li;
+    (*n)++;
+  }
+  ierr = PetscFClose(comm,fp);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "SolveEnsemble"
+/*
+   SolveEnsemble - Solves every (p,lambda) instance of the ensemble file, one group of ranks per instance
+
+   snes lives on one of the equal subcommunicators PETSC_COMM_WORLD was split
+   into; group g of G solves instances g, g+G, g+2G, ... in turn, each from
+   FormInitialGuess(), reusing the DMDA, the vectors, the matrices and the
+   solver of the group.  Then one CSV row per instance is printed in order,
+   followed by the throughput of the whole ensemble.
+ */
+static PetscErrorCode SolveEnsemble(SNES snes,Vec X,AppCtx *user,const char file[])
+{
+  MPI_Comm            comm;
+  PetscMPIInt         wrank,wsize,size,rank;
+  PetscInt            n,k,ngroups,group,its,lits;
+  PetscReal           *p,*lambda,*res,*sum,fnorm;
+  PetscLogDouble      t0,t1,tstart,tend;
+  SNESConvergedReason reason;
+  DM                  dm;
+  Vec                 F;
+  PetscErrorCode      ierr;
+
+  PetscFunctionBegin;
+  ierr    = PetscObjectGetComm((PetscObject)snes,&comm);CHKERRQ(ierr);
+  ierr    = MPI_Comm_rank(PETSC_COMM_WORLD,&wrank);CHKERRQ(ierr);
+  ierr    = MPI_Comm_size(PETSC_COMM_WORLD,&wsize);CHKERRQ(ierr);
+  ierr    = MPI_Comm_rank(comm,&rank);CHKERRQ(ierr);
+  ierr    = MPI_Comm_size(comm,&size);CHKERRQ(ierr);
+  ngroups = wsize/size;
+  group   = wrank/size;
+  ierr    = ReadEnsemble(PETSC_COMM_WORLD,file,&n,&p,&lambda);CHKERRQ(ierr);
+  ierr    = SNESGetDM(snes,&dm);CHKERRQ(ierr);
+  /* per instance: reason, Newton iterations, linear iterations, final residual norm, time */
+  ierr    = PetscCalloc2(5*n,&res,5*n,&sum);CHKERRQ(ierr);
+  ierr    = MPI_Barrier(PETSC_COMM_WORLD);CHKERRQ(ierr);
+  ierr    = PetscTime(&tstart);CHKERRQ(ierr);
+  for (k=group; k<n; k+=ngroups) {
+    user->p      = p[k];
+    user->lambda = lambda[k];
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = FormInitialGuess(dm,X);CHKERRQ(ierr);
+    ierr = SNESSolve(snes,PETSC_NULL,X);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetLinearSolveIterations(snes,&lits);CHKERRQ(ierr);
+    ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+    ierr = VecNorm(F,NORM_2,&fnorm);CHKERRQ(ierr);
+    if (!rank) {
+      res[5*k]   = reason;
+      res[5*k+1] = its;
+      res[5*k+2] = lits;
+      res[5*k+3] = fnorm;
+      res[5*k+4] = t1-t0;
+    }
+  }
+  ierr = MPI_Barrier(PETSC_COMM_WORLD);CHKERRQ(ierr);
+  ierr = PetscTime(&tend);CHKERRQ(ierr);
+  ierr = MPI_Allreduce(res,sum,5*n,MPIU_REAL,MPIU_SUM,PETSC_COMM_WORLD);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"instance,p,lambda,reason,newton_its,linear_its,fnorm,time_s\n");CHKERRQ(ierr);
+  for (k=0; k<n; k++) {
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"%D,%g,%g,%s,%D,%D,%g,%g\n",k,(double)p[k],(double)lambda[k],SNESConvergedReasons[(int)sum[5*k]],
+                       (PetscInt)sum[5*k+1],(PetscInt)sum[5*k+2],(double)sum[5*k+3],(double)sum[5*k+4]);CHKERRQ(ierr);
+  }
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"Ensemble: %D instances on %D groups of %d ranks, %g s, %g solves/s\n",
+                     n,ngroups,(int)size,tend-tstart,tend > tstart ? n/(tend-tstart) : 0.0);CHKERRQ(ierr);
+  ierr = PetscFree2(res,sum);CHKERRQ(ierr);
+  ierr = PetscFree2(p,lambda);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "SolveServer"
+/*
+   SolveServer - Solves the request on each line of file (- for standard input), until its end
+   or a line quit, keeping the process and its solver between requests
+
+   Input Parameters:
+   snes      - nonlinear solver, set up on *dm
+   dm        - grid of the requests that do not give a size
+   X         - solution vector on *dm
+   file      - file of requests
+   partition - process grid of a new DMDA, as for the grid of the command line
+
+   Output Parameters:
+   dm - grid of the last request
+   X  - solution of the last request
+
+   A request is a line of options among -da_grid_x, -da_grid_y (and -da_grid_z in 3D), -p,
+   -lambda, -snes_rtol, -snes_atol, -snes_stol, -snes_max_it, -ksp_rtol and -ksp_max_it;
+   those not given keep the value of the previous request, and all other options are
+   those of the command line, processed once at startup.  Blank lines and lines
+   starting with # are skipped.  Only a new grid size rebuilds anything: a new DMDA,
+   with the boundary types and stencil of the old one, which takes over its DMSNES
+   callbacks, and then the matrices and preconditioner in SNESSetUp().  Each request
+   is solved from FormInitialGuess(); its time is reported split into setup (parsing,
+   rebuilding, SNESSetUp() and initial guess) and SNESSolve().
+ */
+static PetscErrorCode SolveServer(SNES snes,DM *dm,Vec *X,AppCtx *user,const char file[],PBratuPartitionType partition)
+{
+  MPI_Comm            comm;
+  FILE                *fp;
+  char                line[PETSC_MAX_PATH_LEN],*s,*t;
+  PetscBool           isstdin,quit,rebuild;
+  PetscOptions        opts;
+  PetscInt            n = 0,nline = 0,nleft,dim,dof,sw,M[3],Mn[3],maxit,maxf,kmaxit,its,lits;
+  PetscReal           atol,rtol,stol,krtol,katol,kdtol,fnorm;
+  PetscLogDouble      t0,t1,t2,tsetup = 0,tsolve = 0;
+  DMBoundaryType      bx,by,bz;
+  DMDAStencilType     st;
+  SNESConvergedReason reason;
+  KSP                 ksp;
+  DM                  dmn;
+  Vec                 F;
+  PetscErrorCode      ierr;
+
+  PetscFunctionBegin;
+  ierr = PetscObjectGetComm((PetscObject)snes,&comm);CHKERRQ(ierr);
+  ierr = SNESGetKSP(snes,&ksp);CHKERRQ(ierr);
+  ierr = PetscStrcmp(file,"-",&isstdin);CHKERRQ(ierr);
+  if (isstdin) fp = stdin;
+  else {ierr = PetscFOpen(comm,file,"r",&fp);CHKERRQ(ierr);}
+  for (;;) {
+    ierr = PetscSynchronizedFGets(comm,fp,sizeof(line),line);CHKERRQ(ierr);
+    if (!line[0]) break;
+    nline++;
+    for (s=line; *s == ' ' || *s == '\t'; s++) ;
+    for (t=s; *t && *t != '\n' && *t != '\r'; t++) ;
+    *t = 0;
+    if (*s == '#' || !*s) continue;
+    ierr = PetscStrncmp(s,"quit",4,&quit);CHKERRQ(ierr);
+    if (quit) break;
+
+    /* parse the request; the options it does not give keep their values */
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = DMDAGetInfo(*dm,&dim,&M[0],&M[1],&M[2],PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,&dof,&sw,&bx,&by,&bz,&st);CHKERRQ(ierr);
+    Mn[0] = M[0]; Mn[1] = M[1]; Mn[2] = M[2];
+    ierr = SNESGetTolerances(snes,&atol,&rtol,&stol,&maxit,&maxf);CHKERRQ(ierr);
+    ierr = KSPGetTolerances(ksp,&krtol,&katol,&kdtol,&kmaxit);CHKERRQ(ierr);
+    ierr = PetscOptionsCreate(&opts);CHKERRQ(ierr);
+    ierr = PetscOptionsInsertString(opts,s);CHKERRQ(ierr);
+    ierr = PetscOptionsGetInt(opts,NULL,"-da_grid_x",&Mn[0],NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetInt(opts,NULL,"-da_grid_y",&Mn[1],NULL);CHKERRQ(ierr);
+    if (dim == 3) {ierr = PetscOptionsGetInt(opts,NULL,"-da_grid_z",&Mn[2],NULL);CHKERRQ(ierr);}
+    ierr = PetscOptionsGetReal(opts,NULL,"-p",&user->p,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetReal(opts,NULL,"-lambda",&user->lambda,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetReal(opts,NULL,"-snes_rtol",&rtol,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetReal(opts,NULL,"-snes_atol",&atol,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetReal(opts,NULL,"-snes_stol",&stol,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetInt(opts,NULL,"-snes_max_it",&maxit,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetReal(opts,NULL,"-ksp_rtol",&krtol,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsGetInt(opts,NULL,"-ksp_max_it",&kmaxit,NULL);CHKERRQ(ierr);
+    ierr = PetscOptionsAllUsed(opts,&nleft);CHKERRQ(ierr);
+    if (nleft) {
+      ierr = PetscPrintf(comm,"Line %D of %s: only the grid size, p, lambda and the SNES and KSP tolerances change per request\n",nline,file);CHKERRQ(ierr);
+      ierr = PetscOptionsLeft(opts);CHKERRQ(ierr);
+    }
+    ierr = PetscOptionsDestroy(&opts);CHKERRQ(ierr);
+    if (user->p < 1 || user->lambda < 0) SETERRQ2(comm,PETSC_ERR_ARG_OUTOFRANGE,"Line %D of %s: p must be at least 1 and lambda nonnegative",nline,file);
+    ierr = SNESSetTolerances(snes,atol,rtol,stol,maxit,maxf);CHKERRQ(ierr);
+    ierr = KSPSetTolerances(ksp,krtol,katol,kdtol,kmaxit);CHKERRQ(ierr);
+
+    /*
+       A new grid size needs a new DMDA; as in SolveGridSequence(), the SNES is reset
+       onto it, and it inherits the callbacks set up in main() with the DMSNES
+    */
+    rebuild = (PetscBool)(Mn[0] != M[0] || Mn[1] != M[1] || Mn[2] != M[2]);
+    if (rebuild) {
+      if (dim == 3) {
+        ierr = DMDACreate3d(comm,bx,by,bz,st,Mn[0],Mn[1],Mn[2],PETSC_DECIDE,PETSC_DECIDE,PETSC_DECIDE,dof,sw,PETSC_NULL,PETSC_NULL,PETSC_NULL,&dmn);CHKERRQ(ierr);
+      } else {
+        ierr = DMDACreate2d(comm,bx,by,st,Mn[0],Mn[1],PETSC_DECIDE,PETSC_DECIDE,dof,sw,PETSC_NULL,PETSC_NULL,&dmn);CHKERRQ(ierr);
+      }
+      ierr = DMSetFromOptions(dmn);CHKERRQ(ierr);
+      /* the size of the request, over -da_grid_x and -da_refine of the command line */
+      ierr = DMDASetSizes(dmn,Mn[0],Mn[1],Mn[2]);CHKERRQ(ierr);
+      if (partition == PBRATU_PARTITION_HALO) {ierr = SetUpPartition(dmn);CHKERRQ(ierr);}
+      ierr = DMSetUp(dmn);CHKERRQ(ierr);
+      ierr = DMCopyDMSNES(*dm,dmn);CHKERRQ(ierr);
+      ierr = DMSetApplicationContext(dmn,user);CHKERRQ(ierr);
+      ierr = VecDestroy(X);CHKERRQ(ierr);
+      ierr = DMDestroy(dm);CHKERRQ(ierr);
+      *dm  = dmn;
+      ierr = DMCreateGlobalVector(*dm,X);CHKERRQ(ierr);
+
+      ierr = SNESReset(snes);CHKERRQ(ierr);
+      ierr = SNESSetDM(snes,*dm);CHKERRQ(ierr);
+      ierr = SetUpMultigridRestriction(snes,user);CHKERRQ(ierr);
+      ierr = SetUpJacobianShell(snes,user);CHKERRQ(ierr);
+    }
+    ierr = SNESSetUp(snes);CHKERRQ(ierr);
+    ierr = FormInitialGuess(*dm,*X);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = SNESSolve(snes,PETSC_NULL,*X);CHKERRQ(ierr);
+    ierr = PetscTime(&t2);CHKERRQ(ierr);
+    tsetup += t1-t0;
+    tsolve += t2-t1;
+
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetLinearSolveIterations(snes,&lits);CHKERRQ(ierr);
+    ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+    ierr = VecNorm(F,NORM_2,&fnorm);CHKERRQ(ierr);
+    ierr = PetscPrintf(comm,"Request %D: %D x %D",n,Mn[0],Mn[1]);CHKERRQ(ierr);
+    if (dim == 3) {ierr = PetscPrintf(comm," x %D",Mn[2]);CHKERRQ(ierr);}
+    ierr = PetscPrintf(comm," grid%s, p = %g, lambda = %g: %s, %D Newton iterations, %D linear iterations, final residual norm %g; setup %g s, solve %g s\n",
+                       rebuild ? " (new DMDA)" : "",(double)user->p,(double)user->lambda,SNESConvergedReasons[reason],its,lits,(double)fnorm,t1-t0,t2-t1);CHKERRQ(ierr);
+    n++;
+  }
+  if (!isstdin) {ierr = PetscFClose(comm,fp);CHKERRQ(ierr);}
+  ierr = PetscPrintf(comm,"Server: %D requests, setup %g s, solve %g s\n",n,tsetup,tsolve);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "ComparePrecision"
+/*
+   ComparePrecision - Solves from the initial guess X with PetscScalar and then with single
+   precision coefficients of the matrix-free Jacobian, and compares the two solves
+
+   For each, the Newton and linear iteration counts, time to solution and 2-norm of
+   the final residual are printed, then the relative difference of the solutions.
+   On return X holds the solution of the single precision solve.
+ */
+static PetscErrorCode ComparePrecision(SNES snes,Vec X,AppCtx *user)
+{
+  const PBratuPrecisionType prec[2] = {PBRATU_PRECISION_DOUBLE,PBRATU_PRECISION_SINGLE};
+  PetscInt                  k,its,lits;
+  PetscReal                 fnorm,xnorm,dnorm;
+  PetscLogDouble            t0,t1;
+  SNESConvergedReason       reason;
+  Vec                       X0,Xd,F;
+  PetscErrorCode            ierr;
+
+  PetscFunctionBegin;
+  ierr = VecDuplicate(X,&X0);CHKERRQ(ierr);
+  ierr = VecDuplicate(X,&Xd);CHKERRQ(ierr);
+  ierr = VecCopy(X,X0);CHKERRQ(ierr);
+  for (k=0; k<2; k++) {
+    user->jprecision = prec[k];
+    ierr = SetUpJacobianShell(snes,user);CHKERRQ(ierr);
+    ierr = SNESSetUp(snes);CHKERRQ(ierr);
+    ierr = VecCopy(X0,X);CHKERRQ(ierr);
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = SNESSolve(snes,PETSC_NULL,X);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetLinearSolveIterations(snes,&lits);CHKERRQ(ierr);
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+    ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+    ierr = VecNorm(F,NORM_2,&fnorm);CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"%-6s precision Jacobian: %s, %D Newton iterations, %D linear iterations, %g s, final residual norm %g\n",
+                       PBratuPrecisionTypes[prec[k]],SNESConvergedReasons[reason],its,lits,t1-t0,(double)fnorm);CHKERRQ(ierr);
+    if (!k) {ierr = VecCopy(X,Xd);CHKERRQ(ierr);}
+  }
+  ierr = VecNorm(Xd,NORM_2,&xnorm);CHKERRQ(ierr);
+  ierr = VecAXPY(Xd,-1.0,X);CHKERRQ(ierr);
+  ierr = VecNorm(Xd,NORM_2,&dnorm);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"Relative difference of the solutions %g\n",(double)(xnorm > 0 ? dnorm/xnorm : dnorm));CHKERRQ(ierr);
+  ierr = VecDestroy(&Xd);CHKERRQ(ierr);
+  ierr = VecDestroy(&X0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "CompareFastMath"
+/*
+   CompareFastMath - Solves from the initial guess X with the math library and then with
+   the approximate exp() and pow() of -pbratu_fastmath, and compares the two solves
+
+   The report is that of ComparePrecision(), with the largest pointwise difference of
+   the solutions besides their relative difference.  On return X holds the solution
+   of the approximate solve, and user->fastmath is set.
+ */
+static PetscErrorCode CompareFastMath(SNES snes,Vec X,AppCtx *user)
+{
+  const char          *name[2] = {"libm","fast"};
+  PetscInt            k,its,lits;
+  PetscReal           fnorm,xnorm,dnorm,dmax;
+  PetscLogDouble      t0,t1;
+  SNESConvergedReason reason;
+  Vec                 X0,Xd,F;
+  PetscErrorCode      ierr;
+
+  PetscFunctionBegin;
+  ierr = VecDuplicate(X,&X0);CHKERRQ(ierr);
+  ierr = VecDuplicate(X,&Xd);CHKERRQ(ierr);
+  ierr = VecCopy(X,X0);CHKERRQ(ierr);
+  for (k=0; k<2; k++) {
+    user->fastmath = (PetscBool)k;
+    ierr = VecCopy(X0,X);CHKERRQ(ierr);
+    ierr = PetscTime(&t0);CHKERRQ(ierr);
+    ierr = SNESSolve(snes,PETSC_NULL,X);CHKERRQ(ierr);
+    ierr = PetscTime(&t1);CHKERRQ(ierr);
+    ierr = SNESGetIterationNumber(snes,&its);CHKERRQ(ierr);
+    ierr = SNESGetLinearSolveIterations(snes,&lits);CHKERRQ(ierr);
+    ierr = SNESGetConvergedReason(snes,&reason);CHKERRQ(ierr);
+    ierr = SNESGetFunction(snes,&F,PETSC_NULL,PETSC_NULL);CHKERRQ(ierr);
+    ierr = VecNorm(F,NORM_2,&fnorm);CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD,"%s exp() and pow(): %s, %D Newton iterations, %D linear iterations, %g s, final residual norm %g\n",
+                       name[k],SNESConvergedReasons[reason],its,lits,t1-t0,(double)fnorm);CHKERRQ(ierr);
+    if (!k) {ierr = VecCopy(X,Xd);CHKERRQ(ierr);}
+  }
+  ierr = VecNorm(Xd,NORM_2,&xnorm);CHKERRQ(ierr);
+  ierr = VecAXPY(Xd,-1.0,X);CHKERRQ(ierr);
+  ierr = VecNorm(Xd,NORM_2,&dnorm);CHKERRQ(ierr);
+  ierr = VecNorm(Xd,NORM_INFINITY,&dmax);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"Relative difference of the solutions %g, largest pointwise difference %g\n",(double)(xnorm > 0 ? dnorm/xnorm : dnorm),(double)dmax);CHKERRQ(ierr);
+  ierr = VecDestroy(&Xd);CHKERRQ(ierr);
+  ierr = VecDestroy(&X0);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "BenchmarkResidual"
+/*
+   BenchmarkResidual - Times n evaluations of the residual kernel FormFunctionLocal() at X
+
+   The ghost points are updated once, so only the kernel is timed.  The
+   effective bandwidth assumes the minimal traffic of 16 bytes per owned point
+   (read x, write f), the convention of STREAM, which does not count the
+   write-allocate of f.  With streambw > 0 the bandwidth is also given as a
+   fraction of that STREAM bandwidth (GB/s).
+ */
+static PetscErrorCode BenchmarkResidual(DM dm,Vec X,AppCtx *user,PetscInt n,PetscReal streambw)
+{
+  DMDALocalInfo  info;
+  Vec            Xloc,F;
+  void           *x,*f;
+  PetscInt       k;
+  PetscLogDouble t0,t1,tlocal,t,flops,bytes,buf[2],sum[2];
+  PetscMPIInt    size;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = DMDAGetLocalInfo(dm,&info);CHKERRQ(ierr);
+  ierr = DMGetLocalVector(dm,&Xloc);CHKERRQ(ierr);
+  ierr = DMGetGlobalVector(dm,&F);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(dm,X,INSERT_VALUES,Xloc);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(dm,F,&f);CHKERRQ(ierr);
+
+  /* one untimed evaluation to fault in the pages of f and the work arrays */
+  for (k=-1; k<n; k++) {
+    if (!k) {
+      ierr = MPI_Barrier(PetscObjectComm((PetscObject)dm));CHKERRQ(ierr);
+      ierr = PetscTime(&t0);CHKERRQ(ierr);
+    }
+    if (info.dim == 3) {
+      ierr = FormFunctionLocal3d(&info,(PetscScalar***)x,(PetscScalar***)f,user);CHKERRQ(ierr);
+    } else {
+      ierr = FormFunctionLocal(&info,(PetscScalar**)x,(PetscScalar**)f,user);CHKERRQ(ierr);
+    }
+  }
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  tlocal = t1-t0;
+
+  ierr = DMDAVecRestoreArray(dm,F,&f);CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArray(dm,Xloc,&x);CHKERRQ(ierr);
+  ierr = DMRestoreGlobalVector(dm,&F);CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(dm,&Xloc);CHKERRQ(ierr);
+
+  buf[0] = n*ResidualFlops(&info,user);
+  buf[1] = n*16.0*info.xm*info.ym*(info.dim == 3 ? info.zm : 1);
+  ierr   = MPI_Allreduce(buf,sum,2,MPI_DOUBLE,MPI_SUM,PetscObjectComm((PetscObject)dm));CHKERRQ(ierr);
+  ierr   = MPI_Allreduce(&tlocal,&t,1,MPI_DOUBLE,MPI_MAX,PetscObjectComm((PetscObject)dm));CHKERRQ(ierr);
+  ierr   = MPI_Comm_size(PetscObjectComm((PetscObject)dm),&size);CHKERRQ(ierr);
+  flops  = sum[0];
+  bytes  = sum[1];
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"Residual benchmark: %D evaluations, %D x %D",n,info.mx,info.my);CHKERRQ(ierr);
+  if (info.dim == 3) {ierr = PetscPrintf(PETSC_COMM_WORLD," x %D",info.mz);CHKERRQ(ierr);}
+  ierr = PetscPrintf(PETSC_COMM_WORLD," grid, %d ranks, kernel %s, p = %g, lambda = %g\n",
+                     size,PBratuKernelTypes[user->kernel],(double)user->p,(double)user->lambda);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"  %g s per evaluation, %g GF/s, %g GB/s effective",t/n,flops/t*1e-9,bytes/t*1e-9);CHKERRQ(ierr);
+  if (streambw > 0) {
+    ierr = PetscPrintf(PETSC_COMM_WORLD," (%.1f%% of STREAM %g GB/s)",100*bytes/t*1e-9/streambw,(double)streambw);CHKERRQ(ierr);
+  }
+  ierr = PetscPrintf(PETSC_COMM_WORLD,"\n");CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "MemoryReport"
+/*
+   MemoryReport - Prints the peak PetscMalloc() usage and the peak resident set size of each rank of comm
+
+   The resident set peak requires PetscMemorySetGetMaximumUsage() to have been called; a
+   PetscMalloc() peak of 0 means that PetscMalloc() is not being traced (see -malloc).
+ */
+static PetscErrorCode MemoryReport(MPI_Comm comm)
+{
+  PetscLogDouble mal,mem;
+  PetscMPIInt    rank;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MPI_Comm_rank(comm,&rank);CHKERRQ(ierr);
+  ierr = PetscMallocGetMaximumUsage(&mal);CHKERRQ(ierr);
+  ierr = PetscMemoryGetMaximumUsage(&mem);CHKERRQ(ierr);
+  ierr = PetscSynchronizedPrintf(comm,"[%d] Peak memory: PetscMalloc() %g MiB, resident set %g MiB\n",rank,mal/1048576,mem/1048576);CHKERRQ(ierr);
+  ierr = PetscSynchronizedFlush(comm,PETSC_STDOUT);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "SetUpPartition"
+/*
+   SetUpPartition - Sets the process grid of the DMDA with the shortest cuts between the
+   subdomains, and ownership ranges that split each direction evenly
+
+   An m x n process grid of an Mx x My grid cuts it along (m-1) My + (n-1) Mx edges (in 3D,
+   faces of area (m-1) My Mz + (n-1) Mx Mz + (p-1) Mx My), and each ghost point exchange
+   moves s points across each cut edge per side, s the stencil width.  A periodic direction
+   split among m > 1 ranks has m cuts, the wrap-around included.  Every factorization
+   of the number of ranks that leaves each rank at least s points per direction is
+   considered: for long, thin grids the shortest cuts are all across the long direction.
+   Must be called after the grid size is final and before DMSetUp().
+ */
+static PetscErrorCode SetUpPartition(DM dm)
+{
+  PetscInt       dim,M[3],s,m[3],best[3],i,j,d,*l[3];
+  DMBoundaryType bt[3];
+  PetscMPIInt    size;
+  PetscReal      cut,mincut = PETSC_MAX_REAL;
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MPI_Comm_size(PetscObjectComm((PetscObject)dm),&size);CHKERRQ(ierr);
+  ierr = DMDAGetInfo(dm,&dim,&M[0],&M[1],&M[2],PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,
+                     PETSC_IGNORE,&s,&bt[0],&bt[1],&bt[2],PETSC_IGNORE);CHKERRQ(ierr);
+  if (dim == 2) M[2] = 1;
+  best[0] = best[1] = best[2] = 0;
+  for (i=1; i<=size; i++) {
+    if (size % i) continue;
+    for (j=1; j<=size/i; j++) {
+      if ((size/i) % j) continue;
+      m[0] = i; m[1] = j; m[2] = size/(i*j);
+      if (dim == 2 && m[2] > 1) continue;
+      for (d=0; d<dim; d++) if (M[d] < m[d]*s) break;
+      if (d < dim) continue;
+      for (cut=0,d=0; d<dim; d++) {
+        PetscInt ncut = (bt[d] == DM_BOUNDARY_PERIODIC && m[d] > 1) ? m[d] : m[d]-1;
+
+        cut += (PetscReal)ncut*M[0]*M[1]*M[2]/M[d];
+      }
+      if (cut < mincut) {
+        mincut = cut;
+        best[0] = m[0]; best[1] = m[1]; best[2] = m[2];
+      }
+    }
+  }
+  if (!best[0]) SETERRQ4(PetscObjectComm((PetscObject)dm),PETSC_ERR_ARG_OUTOFRANGE,"-pbratu_partition halo: no process grid of %d ranks leaves %D points per direction of the %D x %D grid to each rank",(int)size,s,M[0],M[1]);
+
+  ierr = PetscMalloc3(best[0],&l[0],best[1],&l[1],best[2],&l[2]);CHKERRQ(ierr);
+  for (d=0; d<3; d++) {
+    for (i=0; i<best[d]; i++) l[d][i] = M[d]/best[d] + (i < M[d] % best[d]);
+  }
+  ierr = DMDASetNumProcs(dm,best[0],best[1],dim == 3 ? best[2] : PETSC_DECIDE);CHKERRQ(ierr);
+  ierr = DMDASetOwnershipRanges(dm,l[0],l[1],dim == 3 ? l[2] : PETSC_NULL);CHKERRQ(ierr);
+  ierr = PetscFree3(l[0],l[1],l[2]);CHKERRQ(ierr);
+  PetscFunctionReturn(0);
+}
+
+/* ------------------------------------------------------------------- */
+#undef __FUNCT__
+#define __FUNCT__ "PartitionReport"
+/*
+   PartitionReport - Prints the process grid of the DMDA, the owned and ghost points of each
+   rank, and the largest and mean counts over the ranks
+
+   The ghost points of a rank are those of its ghosted local vector that it does not own,
+   i.e. what each ghost point exchange receives; the largest count over the mean is the
+   imbalance (1 is perfect balance).
+ */
+static PetscErrorCode PartitionReport(DM dm)
+{
+  MPI_Comm       comm = PetscObjectComm((PetscObject)dm);
+  PetscMPIInt    rank,size;
+  PetscInt       dim,M,N,P,m,n,p,xs,ys,zs,xm,ym,zm,gxm,gym,gzm;
+  PetscLogDouble loc[2],max[2],sum[2];
+  PetscErrorCode ierr;
+
+  PetscFunctionBegin;
+  ierr = MPI_Comm_rank(comm,&rank);CHKERRQ(ierr);
+  ierr = MPI_Comm_size(comm,&size);CHKERRQ(ierr);
+  ierr = DMDAGetInfo(dm,&dim,&M,&N,&P,&m,&n,&p,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE,PETSC_IGNORE);CHKERRQ(ierr);
+  ierr = DMDAGetCorners(dm,&xs,&ys,&zs,&xm,&ym,&zm);CHKERRQ(ierr);
+  ierr = DMDAGetGhostCorners(dm,PETSC_NULL,PETSC_NULL,PETSC_NULL,&gxm,&gym,&gzm);CHKERRQ(ierr);
+  loc[0] = (PetscLogDouble)xm*ym*zm;
+  loc[1] = (PetscLogDouble)gxm*gym*gzm - loc[0];
+  if (dim == 3) {
+    ierr = PetscPrintf(comm,"Process grid %D x %D x %D of the %D x %D x %D grid\n",m,n,p,M,N,P);CHKERRQ(ierr);
+    ierr = PetscSynchronizedPrintf(comm,"[%d] x %D-%D, y %D-%D, z %D-%D: %.0f owned, %.0f ghost points\n",rank,xs,xs+xm-1,ys,ys+ym-1,zs,zs+zm-1,loc[0],loc[1]);CHKERRQ(ierr);
+  } else {
+    ierr = PetscPrintf(comm,"Process grid %D x %D of the %D x %D grid\n",m,n,M,N);CHKERRQ(ierr);
+    ierr = PetscSynchronizedPrintf(comm,"[%d] x %D-%D, y %D-%D: %.0f owned, %.0f ghost points\n",rank,xs,xs+xm-1,ys,ys+ym-1,loc[0],loc[1]);CHKERRQ(ierr);
+  }
+  ierr = PetscSynchronizedFlush(comm,PETSC_STDOUT);CHKERRQ(ierr);
+  ierr = MPI_Allreduce(loc,max,2,MPI_DOUBLE,MPI_MAX,comm);CHKERRQ(ierr);
+  ierr = MPI_Allreduce(loc,sum,2,MPI_DOUBLE,MPI_SUM,comm);CHKERRQ(ierr);
+  ierr = PetscPrintf(comm,"Owned points: max %.0f, mean %.1f, imbalance %.3f; ghost points: max %.0f, mean %.1f, imbalance %.3f, total %.0f\n",
+                     max[0],sum[0]/size,max[0]*size/sum[0],max[1],sum[1]/size,sum[1] > 0 ? max[1]*size/sum[1] : 1.0,sum[1]);CHKERRQ(ierr);
   PetscFunctionReturn(0);
 }
@@ -0,0 +1,257 @@
+/*
+   CUDA implementation of the p-Bratu residual and of the matrix-free Jacobian of pbratu.c,
+   used when the DMDA's vectors are VECCUDA (-dm_vec_type cuda); see pbratu_cuda.h.
+
+   One thread handles one owned point.  The discretization is that of pbratu.c: the
+   diffusive flux through each cell face is eta(gamma) times the normal derivative,
+   with the tangential derivative averaged over the four points adjacent to the face.
+   The residual kernel computes the four face fluxes of its point, so each interior
+   face is evaluated by both adjacent threads; the Jacobian coefficient kernel
+   evaluates every face once.
+*/
+#include "pbratu_cuda.h"
+
+#if defined(PETSC_USE_COMPLEX)
+#error "The CUDA kernels of pbratu require real scalars"
+#endif
+
+#define PBRATU_CUDA_BLOCK_X 32
+#define PBRATU_CUDA_BLOCK_Y 8
+
+#define CHKERRCUDA_PBRATU(cerr) do {if ((cerr) != cudaSuccess) SETERRQ1(PETSC_COMM_SELF,PETSC_ERR_LIB,"CUDA error: %s",cudaGetErrorString(cerr));} while (0)
+
+/*
+   Interior points is <= i < ie, js <= j < je of the owned block
+*/
+__host__ __device__ static inline void InteriorRange(const PBratuCUDAGrid &g,PetscInt *is,PetscInt *ie,PetscInt *js,PetscInt *je)
+{
+  *is = g.xs > 1 ? g.xs : 1;
+  *ie = g.xs+g.xm < g.mx-1 ? g.xs+g.xm : g.mx-1; if (*ie < *is) *ie = *is;
+  *js = g.ys > 1 ? g.ys : 1;
+  *je = g.ys+g.ym < g.my-1 ? g.ys+g.ym : g.my-1; if (*je < *js) *je = *js;
+}
+
+/*
+   Gradient on the x-face (i+1/2,j) and the y-face (i,j+1/2); xc points to x[j][i] and s is the row stride
+*/
+__device__ static inline void GradXFace(const PetscScalar *xc,PetscInt s,PetscReal dhx,PetscReal dhy,PetscScalar *ux,PetscScalar *uy)
+{
+  *ux = dhx*(xc[1]-xc[0]);
+  *uy = 0.25*dhy*(xc[s]+xc[s+1]-xc[-s]-xc[1-s]);
+}
+__device__ static inline void GradYFace(const PetscScalar *xc,PetscInt s,PetscReal dhx,PetscReal dhy,PetscScalar *ux,PetscScalar *uy)
+{
+  *ux = 0.25*dhx*(xc[1]+xc[s+1]-xc[-1]-xc[s-1]);
+  *uy = dhy*(xc[s]-xc[0]);
+}
+
+/*
+   Face coefficients of the linearized flux cn*du_n + ct*du_t, without the mesh factors:
+   cn = eta + deta u_n^2, ct = deta u_n u_t
+*/
+__device__ static inline void FaceCoefficients(PetscScalar un,PetscScalar ut,PetscReal e2,PetscReal p,PetscScalar *cn,PetscScalar *ct)
+{
+  const PetscReal   q     = 0.5*(p-2.);
+  const PetscScalar base  = e2+0.5*(un*un + ut*ut),
+                    e     = p == 2 ? 1.0 : pow(base,q),
+                    de    = p == 2 ? 0.0 : q*pow(base,q-1);
+  *cn = e + de*un*un;
+  *ct = de*un*ut;
+}
+
+__global__ static void ResidualKernel(PBratuCUDAGrid g,PetscReal lambda,PetscReal p,PetscReal epsilon,
+                                      const PetscScalar *__restrict__ x,PetscScalar *__restrict__ f)
+{
+  const PetscInt    i = g.xs + blockIdx.x*blockDim.x + threadIdx.x,
+                    j = g.ys + blockIdx.y*blockDim.y + threadIdx.y,
+                    s = g.gxm;
+  const PetscScalar *xc;
+  const PetscReal   hx = 1./(PetscReal)(g.mx-1),hy = 1./(PetscReal)(g.my-1),dhx = 1/hx,dhy = 1/hy,
+                    e2 = epsilon*epsilon,q = 0.5*(p-2.);
+  PetscScalar       ux,uy,fE,fW,fN,fS;
+
+  if (i >= g.xs+g.xm || j >= g.ys+g.ym) return;
+  xc = x + (j-g.gys)*s + (i-g.gxs);
+  if (i == 0 || j == 0 || i == g.mx-1 || j == g.my-1) {
+    /* homogeneous Dirichlet boundary condition */
+    f[(j-g.ys)*g.xm + (i-g.xs)] = xc[0];
+    return;
+  }
+  GradXFace(xc,s,dhx,dhy,&ux,&uy);   fE = (p == 2 ? 1.0 : pow(e2+0.5*(ux*ux + uy*uy),q))*ux;
+  GradXFace(xc-1,s,dhx,dhy,&ux,&uy); fW = (p == 2 ? 1.0 : pow(e2+0.5*(ux*ux + uy*uy),q))*ux;
+  GradYFace(xc,s,dhx,dhy,&ux,&uy);   fN = (p == 2 ? 1.0 : pow(e2+0.5*(ux*ux + uy*uy),q))*uy;
+  GradYFace(xc-s,s,dhx,dhy,&ux,&uy); fS = (p == 2 ? 1.0 : pow(e2+0.5*(ux*ux + uy*uy),q))*uy;
+  f[(j-g.ys)*g.xm + (i-g.xs)] = -hy*(fE-fW) - hx*(fN-fS) - hx*hy*lambda*exp(xc[0]);
+}
+
+/*
+   The thread of interior point (i,j) computes its east x-face and north y-face; the
+   threads of the first column and row also compute the west and south faces.
+*/
+__global__ static void JacobianShellCoefficientsKernel(PBratuCUDAGrid g,PetscReal lambda,PetscReal p,PetscReal epsilon,const PetscScalar *__restrict__ x,
+                                                       PetscScalar *__restrict__ cxn,PetscScalar *__restrict__ cxt,
+                                                       PetscScalar *__restrict__ cyn,PetscScalar *__restrict__ cyt,PetscScalar *__restrict__ d)
+{
+  PetscInt          is,ie,js,je,ni;
+  const PetscInt    k = blockIdx.x*blockDim.x + threadIdx.x,r = blockIdx.y*blockDim.y + threadIdx.y,s = g.gxm;
+  const PetscReal   hx = 1./(PetscReal)(g.mx-1),hy = 1./(PetscReal)(g.my-1),dhx = 1/hx,dhy = 1/hy,e2 = epsilon*epsilon;
+  const PetscScalar *xc;
+  PetscScalar       ux,uy,cn,ct;
+
+  InteriorRange(g,&is,&ie,&js,&je);
+  ni = ie-is;
+  if (k >= ni || r >= je-js) return;
+  xc = x + (js+r-g.gys)*s + (is+k-g.gxs);
+
+  GradXFace(xc,s,dhx,dhy,&ux,&uy);
+  FaceCoefficients(ux,uy,e2,p,&cn,&ct);
+  cxn[r*(ni+1)+k+1] = hy*dhx*cn;
+  cxt[r*(ni+1)+k+1] = 0.25*hy*dhy*ct;
+  if (!k) {
+    GradXFace(xc-1,s,dhx,dhy,&ux,&uy);
+    FaceCoefficients(ux,uy,e2,p,&cn,&ct);
+    cxn[r*(ni+1)] = hy*dhx*cn;
+    cxt[r*(ni+1)] = 0.25*hy*dhy*ct;
+  }
+  GradYFace(xc,s,dhx,dhy,&ux,&uy);
+  FaceCoefficients(uy,ux,e2,p,&cn,&ct);
+  cyn[(r+1)*ni+k] = hx*dhy*cn;
+  cyt[(r+1)*ni+k] = 0.25*hx*dhx*ct;
+  if (!r) {
+    GradYFace(xc-s,s,dhx,dhy,&ux,&uy);
+    FaceCoefficients(uy,ux,e2,p,&cn,&ct);
+    cyn[k] = hx*dhy*cn;
+    cyt[k] = 0.25*hx*dhx*ct;
+  }
+  d[r*ni+k] = -hx*hy*lambda*exp(xc[0]);
+}
+
+__global__ static void JacobianShellMultKernel(PBratuCUDAGrid g,const PetscScalar *__restrict__ cxn,const PetscScalar *__restrict__ cxt,
+                                               const PetscScalar *__restrict__ cyn,const PetscScalar *__restrict__ cyt,const PetscScalar *__restrict__ d,
+                                               const PetscScalar *__restrict__ x,PetscScalar *__restrict__ y)
+{
+  PetscInt          is,ie,js,je,ni,k,r,e,n;
+  const PetscInt    i = g.xs + blockIdx.x*blockDim.x + threadIdx.x,
+                    j = g.ys + blockIdx.y*blockDim.y + threadIdx.y,
+                    s = g.gxm;
+  const PetscScalar *xc;
+
+  if (i >= g.xs+g.xm || j >= g.ys+g.ym) return;
+  InteriorRange(g,&is,&ie,&js,&je);
+  xc = x + (j-g.gys)*s + (i-g.gxs);
+  if (i < is || i >= ie || j < js || j >= je) {
+    y[(j-g.ys)*g.xm + (i-g.xs)] = xc[0];
+    return;
+  }
+  ni = ie-is; k = i-is; r = j-js;
+  e  = r*(ni+1)+k+1;  /* east x-face; the west one is e-1 */
+  n  = (r+1)*ni+k;    /* north y-face; the south one is n-ni */
+  y[(j-g.ys)*g.xm + (i-g.xs)] =
+      cxn[e-1]*(xc[0]-xc[-1]) + cxt[e-1]*(xc[s-1]+xc[s]-xc[-s-1]-xc[-s])
+    - cxn[e]*(xc[1]-xc[0])    - cxt[e]*(xc[s]+xc[s+1]-xc[-s]-xc[1-s])
+    + cyn[n-ni]*(xc[0]-xc[-s]) + cyt[n-ni]*(xc[1-s]+xc[1]-xc[-s-1]-xc[-1])
+    - cyn[n]*(xc[s]-xc[0])    - cyt[n]*(xc[1]+xc[s+1]-xc[-1]-xc[s-1])
+    + d[r*ni+k]*xc[0];
+}
+
+__global__ static void JacobianShellDiagonalKernel(PBratuCUDAGrid g,const PetscScalar *__restrict__ cxn,const PetscScalar *__restrict__ cyn,
+                                                   const PetscScalar *__restrict__ d,PetscScalar *__restrict__ diag)
+{
+  PetscInt       is,ie,js,je,ni,k,r;
+  const PetscInt i = g.xs + blockIdx.x*blockDim.x + threadIdx.x,
+                 j = g.ys + blockIdx.y*blockDim.y + threadIdx.y;
+
+  if (i >= g.xs+g.xm || j >= g.ys+g.ym) return;
+  InteriorRange(g,&is,&ie,&js,&je);
+  if (i < is || i >= ie || j < js || j >= je) {
+    diag[(j-g.ys)*g.xm + (i-g.xs)] = 1.0;
+    return;
+  }
+  ni = ie-is; k = i-is; r = j-js;
+  diag[(j-g.ys)*g.xm + (i-g.xs)] = cxn[r*(ni+1)+k] + cxn[r*(ni+1)+k+1] + cyn[r*ni+k] + cyn[(r+1)*ni+k] + d[r*ni+k];
+}
+
+static dim3 ThreadBlocks(PetscInt m,PetscInt n)
+{
+  return dim3((unsigned)((m+PBRATU_CUDA_BLOCK_X-1)/PBRATU_CUDA_BLOCK_X),(unsigned)((n+PBRATU_CUDA_BLOCK_Y-1)/PBRATU_CUDA_BLOCK_Y));
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAResidual"
+PetscErrorCode PBratuCUDAResidual(const PBratuCUDAGrid *g,PetscReal lambda,PetscReal p,PetscReal epsilon,const PetscScalar *x,PetscScalar *f)
+{
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  if (!g->xm || !g->ym) PetscFunctionReturn(0);
+  ResidualKernel<<<ThreadBlocks(g->xm,g->ym),dim3(PBRATU_CUDA_BLOCK_X,PBRATU_CUDA_BLOCK_Y)>>>(*g,lambda,p,epsilon,x,f);
+  cerr = cudaGetLastError();CHKERRCUDA_PBRATU(cerr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAJacobianShellCoefficients"
+PetscErrorCode PBratuCUDAJacobianShellCoefficients(const PBratuCUDAGrid *g,PetscReal lambda,PetscReal p,PetscReal epsilon,const PetscScalar *x,
+                                                   PetscScalar *cxn,PetscScalar *cxt,PetscScalar *cyn,PetscScalar *cyt,PetscScalar *d)
+{
+  PetscInt    is,ie,js,je;
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  InteriorRange(*g,&is,&ie,&js,&je);
+  if (ie == is || je == js) PetscFunctionReturn(0);
+  JacobianShellCoefficientsKernel<<<ThreadBlocks(ie-is,je-js),dim3(PBRATU_CUDA_BLOCK_X,PBRATU_CUDA_BLOCK_Y)>>>(*g,lambda,p,epsilon,x,cxn,cxt,cyn,cyt,d);
+  cerr = cudaGetLastError();CHKERRCUDA_PBRATU(cerr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAJacobianShellMult"
+PetscErrorCode PBratuCUDAJacobianShellMult(const PBratuCUDAGrid *g,const PetscScalar *cxn,const PetscScalar *cxt,const PetscScalar *cyn,
+                                           const PetscScalar *cyt,const PetscScalar *d,const PetscScalar *x,PetscScalar *y)
+{
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  if (!g->xm || !g->ym) PetscFunctionReturn(0);
+  JacobianShellMultKernel<<<ThreadBlocks(g->xm,g->ym),dim3(PBRATU_CUDA_BLOCK_X,PBRATU_CUDA_BLOCK_Y)>>>(*g,cxn,cxt,cyn,cyt,d,x,y);
+  cerr = cudaGetLastError();CHKERRCUDA_PBRATU(cerr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAJacobianShellDiagonal"
+PetscErrorCode PBratuCUDAJacobianShellDiagonal(const PBratuCUDAGrid *g,const PetscScalar *cxn,const PetscScalar *cyn,const PetscScalar *d,PetscScalar *diag)
+{
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  if (!g->xm || !g->ym) PetscFunctionReturn(0);
+  JacobianShellDiagonalKernel<<<ThreadBlocks(g->xm,g->ym),dim3(PBRATU_CUDA_BLOCK_X,PBRATU_CUDA_BLOCK_Y)>>>(*g,cxn,cyn,d,diag);
+  cerr = cudaGetLastError();CHKERRCUDA_PBRATU(cerr);
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAMalloc"
+PetscErrorCode PBratuCUDAMalloc(PetscInt n,PetscScalar **a)
+{
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  *a = NULL;
+  if (n > 0) {cerr = cudaMalloc((void**)a,n*sizeof(PetscScalar));CHKERRCUDA_PBRATU(cerr);}
+  PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PBratuCUDAFree"
+PetscErrorCode PBratuCUDAFree(PetscScalar **a)
+{
+  cudaError_t cerr;
+
+  PetscFunctionBegin;
+  if (*a) {cerr = cudaFree(*a);CHKERRCUDA_PBRATU(cerr);}
+  *a = NULL;
+  PetscFunctionReturn(0);
+}
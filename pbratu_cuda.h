@@ -0,0 +1,35 @@
+#if !defined(PBRATU_CUDA_H)
+#define PBRATU_CUDA_H
+
+/*
+   Device kernels of pbratu, built from pbratu_cuda.cu with make PBRATU_CUDA=1.
+
+   All arrays are device arrays.  x is the ghosted local vector of the DMDA, stored
+   row by row with the ghosted sizes gxm, gym; f and y are owned parts of global
+   vectors, row by row with xm, ym.  The matrix-free Jacobian coefficients are laid
+   out as in the JacobianShell context of pbratu.c.
+*/
+#include <petscsys.h>
+
+typedef struct {
+  PetscInt mx,my;           /* global grid size */
+  PetscInt xs,ys,xm,ym;     /* owned points */
+  PetscInt gxs,gys,gxm,gym; /* points of the ghosted local vector */
+} PBratuCUDAGrid;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+PetscErrorCode PBratuCUDAResidual(const PBratuCUDAGrid*,PetscReal,PetscReal,PetscReal,const PetscScalar*,PetscScalar*);
+PetscErrorCode PBratuCUDAJacobianShellCoefficients(const PBratuCUDAGrid*,PetscReal,PetscReal,PetscReal,const PetscScalar*,
+                                                   PetscScalar*,PetscScalar*,PetscScalar*,PetscScalar*,PetscScalar*);
+PetscErrorCode PBratuCUDAJacobianShellMult(const PBratuCUDAGrid*,const PetscScalar*,const PetscScalar*,const PetscScalar*,
+                                           const PetscScalar*,const PetscScalar*,const PetscScalar*,PetscScalar*);
+PetscErrorCode PBratuCUDAJacobianShellDiagonal(const PBratuCUDAGrid*,const PetscScalar*,const PetscScalar*,const PetscScalar*,PetscScalar*);
+PetscErrorCode PBratuCUDAMalloc(PetscInt,PetscScalar**);
+PetscErrorCode PBratuCUDAFree(PetscScalar**);
+#if defined(__cplusplus)
+}
+#endif
+
+#endif